@@ -1,300 +1,4309 @@
 #include "uart.h"
+#include "rpi_uart_ioctl.h"
+#include "rpi_uart_api.h"
 
+#define CREATE_TRACE_POINTS
+#include "rpi_uart_trace.h"
 
-static struct uart_regs __iomem *uart = NULL;
+
+// Size of the RX ring buffer, must be a power of two
+#define UART_RX_BUF_SIZE 4096
+
+// mmap() size of the RX ring: header page plus data
+#define UART_RX_MAP_SIZE (PAGE_SIZE + PAGE_ALIGN(UART_RX_BUF_SIZE))
+
+// RX timestamp records in the ring's header page, a power of two
+#define UART_RX_STAMPS        128
+#define UART_RX_STAMP_OFFSET  256
+
+// Frame boundaries tracked in packet mode. Empty frames are not recorded,
+// so every frame takes at least two ring bytes and the index cannot
+// overflow while the reader keeps up with it.
+#define UART_RX_FRAMES   (UART_RX_BUF_SIZE / 2)
+
+// Packet mode setting of a port, one word so the IRQ path reads it at once
+#define UART_FRAMING(mode, delim)  (((mode) << 8) | ((delim) & 0xFF))
+#define UART_FRAMING_MODE(f)       ((f) >> 8)
+#define UART_FRAMING_DELIM(f)      ((u8)(f))
+
+// Allowed range for the TX ring size (tx_buf_size module parameter)
+#define UART_TX_BUF_MIN  4096
+#define UART_TX_BUF_MAX  65536
+
+// Default inter-byte timeout of a read. At 9600 baud, each character
+// takes ~1.04ms to transmit (10 bits total), 300ms of no data means the
+// sender is done, even with typing delays.
+#define UART_RX_IDLE_US       300000
+
+// read()/write() move data between userspace and the rings in chunks of this size
+#define UART_CHUNK_SIZE       PAGE_SIZE
+
+// The Mini UART plus PL011 UART0 and UART2-5. Port slot 0 is the Mini
+// UART, slot 1 + i the i-th pl011= entry.
+#define UART_MAX_PORTS        6
+#define PL011_MAX_PORTS       5
+#define UART_MINI_SLOT        0
+
+// rpi_uart_submit_tx() buffers awaiting their done callback, a power of two
+#define UART_TX_REQS          16
+
+// A zero-copy write pins and sends at most this many pages at a time
+#define UART_ZC_PAGES         16
+
+// Single-producer (IRQ handler) / single-consumer (reader) ring buffer.
+// head and tail are free-running, only the producer moves head and only
+// the consumer moves tail, so no lock is needed between the two.
+// A ring with a shared header can be mmap()ed: head is mirrored there
+// and the consumer index is the header's tail, so userspace can consume
+// in place (the backend/reader code is the same either way).
+struct uart_ring {
+    char *buf;
+    unsigned int size;
+    unsigned int head;
+    unsigned int tail;
+    struct rpi_uart_ring_header *shared;
+};
+
+// Per-CPU port statistics. Each CPU only updates its own copy, without
+// locks or atomics, and readers sum the copies (high-water marks take
+// the maximum). Counters wrap like the ones in /proc/net/dev.
+struct uart_stats {
+    unsigned long rx_bytes;
+    unsigned long tx_bytes;
+    unsigned long rx_dropped;      // Lost on a full rx_ring
+    unsigned long rx_overruns;     // RX FIFO overflowed in hardware
+    unsigned long rx_framing_errors;  // PL011 only, like parity and break
+    unsigned long rx_parity_errors;
+    unsigned long rx_breaks;
+    unsigned long irqs;            // Interrupts handled
+    unsigned long rx_polls;        // Adaptive RX polls (Mini UART)
+    unsigned long tx_wait_us;      // Time writers slept on a full tx_ring
+    unsigned long rx_frames;       // Frames found in packet mode
+    unsigned long rx_bad_frames;   // Overlong or invalid COBS frames dropped by read()
+    unsigned long pm_suspends;     // Runtime suspends, clock gated (Mini UART)
+    unsigned long pm_wakeups;      // Resumes from the wake-up interrupt
+    unsigned long pm_wake_us;      // Wake-up edge to receiver running, summed
+    unsigned int rx_high;          // rx_ring high-water mark
+    unsigned int tx_high;          // tx_ring high-water mark
+    unsigned int pm_wake_max_us;   // Longest wake-up
+};
+
+// Raise this CPU's copy of a high-water mark. Preemption is off so the
+// read and the write hit the same CPU's copy, even from process context;
+// an interrupt between them can only lose a smaller sample.
+#define uart_stat_max(ud, field, val) do {                       \
+    unsigned int __v = (val);                                    \
+    struct uart_stats *__s = get_cpu_ptr((ud)->stats);           \
+    if (__v > __s->field)                                        \
+        WRITE_ONCE(__s->field, __v);                             \
+    put_cpu_ptr((ud)->stats);                                    \
+} while (0)
+
+struct uart_dev;
+
+// A kernel consumer attached with rpi_uart_register_rx_cb()
+struct rpi_uart_client {
+    struct uart_dev __rcu *ud;     // NULL once detached
+    rpi_uart_rx_cb_t rx;
+    void *ctx;
+};
+
+// A rpi_uart_submit_tx() buffer waiting for its done callback
+struct uart_tx_req {
+    unsigned int end;              // tx_ring position after its last byte
+    rpi_uart_tx_done_t done;
+    void *ctx;
+};
+
+// A piece of a zero-copy write, sent by the TX path straight from the
+// writer's pinned pages. Lives on the writer's stack while ud->tx_zc
+// points to it; offset, len and pos change under ud->lock.
+struct uart_tx_zc {
+    struct page *pages[UART_ZC_PAGES];
+    size_t offset;                 // Of the data in pages[0]
+    size_t len;
+    size_t pos;                    // Bytes taken by the TX path
+    struct sg_table sgt;           // PL011 DMA mapping of the pages
+    bool mapped;
+};
+
+// A UART hardware backend behind a /dev node. The backend fills
+// rx_ring and drains tx_ring, the front end only touches the rings.
+struct uart_backend {
+    const char *name;
+    const char *dev_name;                                // /dev node name, printf format of the index
+    int (*probe)(struct uart_dev *ud);                   // Find missing resources, init hardware
+    void (*remove)(struct uart_dev *ud);
+    int (*startup)(struct uart_dev *ud);                 // Start moving data between hardware and rings
+    void (*shutdown)(struct uart_dev *ud);
+    void (*start_tx)(struct uart_dev *ud);               // tx_ring has new data
+    int (*set_baud)(struct uart_dev *ud, u32 baudrate);
+    int (*set_loopback)(struct uart_dev *ud, bool on);  // Internal TX to RX loop, optional
+    void (*abort_tx_zc)(struct uart_dev *ud);           // Stop DMA from tx_zc pages, optional
+};
+
+// One driven UART. Every port has its own rings, lock, interrupt and
+// statistics, so ports serviced on different CPUs share no state.
+struct uart_dev {
+    const struct uart_backend *backend;
+    struct device *dev;            // Platform device, NULL for pl011= ports
+    char name[16];                 // /dev node name
+    int index;                     // Hardware instance, e.g. 2 for PL011 UART2
+    unsigned int slot;             // Position in uart_devs and irq_cpu=
+    int irq;
+    int irq_cpu;                   // CPU the interrupt is pinned to, -1 = not pinned
+    bool tty;                      // Driven by the serial_core front end
+    u32 baud;
+    bool loopback;                 // TX looped back to RX inside the UART
+    spinlock_t lock;               // Protects the interrupt mask shadow, baud divisor, DMA state and open counts
+    unsigned int open_count;       // Open files of the /dev node
+    bool open_excl;                // Opened with O_EXCL, further opens fail
+
+    // Open files and mappings of the RX ring keep ud and the rings past
+    // unbind. File operations run under io_sem for reading; unbind sets
+    // gone, wakes every sleeper and takes it for writing, so none of them
+    // reaches the hardware once it is being torn down.
+    struct kref ref;
+    struct rw_semaphore io_sem;
+    bool gone;                     // Unbound, set under lock
+
+    // The rings are single producer, single consumer. Several writers
+    // (or readers) of one port take turns through these, held only while
+    // ring indices move - never while copying to or from user space. The
+    // interrupt side never takes them.
+    spinlock_t tx_lock;            // TX ring producers and tx_req, _bh for rpi_uart_submit_tx()
+    spinlock_t rx_lock;            // RX ring consumers: readers, frame index tail
+
+    struct uart_ring rx_ring;
+    wait_queue_head_t rx_wait;
+    struct rpi_uart_rx_stamp *rx_stamps;  // In the ring's header page
+    u32 rx_err_flags;              // RPI_UART_RX_ERR_* of the burst being pushed (RX path)
+    spinlock_t rx_err_lock;        // rx_err only, nests inside lock
+    struct rpi_uart_rx_errors rx_err;  // Under rx_err_lock
+    struct uart_ring tx_ring;
+    wait_queue_head_t tx_wait;
+    struct uart_tx_zc *tx_zc;      // Zero-copy write holding the TX path, set under tx_lock and lock
+
+    // Packet mode (RPI_UART_IOC_SET_FRAMING). The RX path records the
+    // rx_ring position after each frame's delimiter, the reader pops them.
+    u32 framing;                   // UART_FRAMING(), mode RPI_UART_FRAME_NONE = stream
+    u32 frame_seen;                // framing as last seen by the RX path
+    unsigned int frame_len;        // Bytes of the frame in progress (RX path)
+    unsigned int frame_head;       // Written by the RX path
+    unsigned int frame_tail;       // Written by the reader
+    unsigned int frame_end[UART_RX_FRAMES];
+
+    // Kernel consumer (rpi_uart_api.h). RX data and TX completions reach
+    // it through client_work, outside interrupt context.
+    struct rpi_uart_client *client;  // Set under uart_devs_lock
+    struct work_struct client_work;
+    struct uart_tx_req tx_req[UART_TX_REQS];
+    unsigned int tx_req_head;
+    unsigned int tx_req_tail;
+
+    struct uart_stats __percpu *stats;
+    struct dentry *debugfs;        // Statistics file, rpi_uart/<name>
+
+    struct clk *clk;
+    unsigned long clock_rate;
+    struct notifier_block clk_nb;
+
+    struct miscdevice miscdev;
+    struct uart_port port;         // tty=1 only
+
+    // Mini UART
+    struct uart_regs __iomem *regs;
+    u32 ier;                       // Shadow of MU_IER
+    bool mux_pins;                 // No pinctrl state in device tree, mux GPIO14/15 here
+    bool rtscts;                   // RTS/CTS pins in use (rtscts=1)
+    bool rx_polling;               // RX interrupt off, rx_poll_timer drains the FIFO
+    bool pm;                       // Runtime PM enabled (misc device front end)
+    bool suspended;                // Clock gated, set under lock; MU_IER writes wait for resume
+    int wake_irq;                  // "wakeup" interrupt on the RX line, 0 = none
+    bool wake_armed;               // wake_irq enabled, under lock
+    ktime_t wake_edge;             // When wake_irq fired, under lock
+    unsigned int rx_poll_empty;    // Polls in a row that found no data
+    unsigned int rx_irq_count;     // RX interrupts in the current window
+    ktime_t rx_irq_window;         // End of the current 1 ms window
+    struct hrtimer rx_poll_timer;
+
+    // PL011
+    void __iomem *base;
+    phys_addr_t phys;              // Register address (Mini UART: MU_IO)
+    struct device_node *np;
+    struct device *pin_dev;        // Device of np whose pinctrl state is applied, NULL = muxed here
+    struct pinctrl *pinctrl;
+    u32 imsc;                      // Shadow of PL011_IMSC
+    struct dma_chan *tx_chan;
+    dma_addr_t tx_ring_dma;        // tx_ring.buf mapped for the DMA engine
+    unsigned int tx_dma_len;       // Bytes in flight, 0 when idle
+    bool tx_dma_zc;                // The transfer in flight reads tx_zc's pages
+    struct dma_chan *rx_chan;
+    char *rx_dma_buf;
+    dma_addr_t rx_dma;
+    dma_cookie_t rx_cookie;
+    unsigned int rx_dma_pos;       // Next unread offset in rx_dma_buf
+    struct hrtimer rx_timer;
+};
+
+// Per open file settings of a /dev node
+struct uart_file {
+    struct uart_dev *ud;
+    bool excl; // Holds the port, opened with O_EXCL (cleared from f_flags after open)
+    bool raw;  // Binary mode: no newline translation, NUL bytes kept
+    struct rpi_uart_read_timing timing;  // When a blocking read returns
+    struct rpi_uart_rx_stamp rx_stamp;   // Of the last read's first byte
+    u32 rx_err_seen;                     // rx_err.events fetched, EPOLLPRI until current
+};
+
+// The GPIO block is shared by all ports, pins are only muxed at probe
 static void __iomem *gpio = NULL;
-static struct proc_dir_entry *proc_tx;
-static struct proc_dir_entry *proc_rx;
+static bool gpio_has_pupdn;        // BCM2711 GPPUPPDN pull registers (BCM2835/7 differ)
+static DEFINE_MUTEX(uart_devs_lock);  // Ports come and go with asynchronous probe
+static DEFINE_SPINLOCK(uart_gpio_lock);  // GPFSEL/GPPUPPDN read-modify-writes of all ports
+static struct uart_dev *uart_devs[UART_MAX_PORTS];
+static DEFINE_MUTEX(uart_irq_lock);   // uart_irq_pinned
+static struct uart_dev *uart_irq_pinned[UART_MAX_PORTS];  // By slot, ports whose IRQ is pinned
+static struct dentry *uart_debugfs_dir;
+
+static u32 uart_baud = 9600;
+
+static unsigned int tx_buf_size = UART_TX_BUF_MIN;
+module_param(tx_buf_size, uint, 0444);
+MODULE_PARM_DESC(tx_buf_size, "TX ring size in bytes, 4096-65536 (rounded up to a power of two)");
+
+static bool default_raw;
+module_param_named(raw, default_raw, bool, 0644);
+MODULE_PARM_DESC(raw, "Open the UART devices in binary mode by default (no CR/LF translation or NUL dropping)");
+
+static unsigned int rx_idle_us = UART_RX_IDLE_US;
+module_param(rx_idle_us, uint, 0644);
+MODULE_PARM_DESC(rx_idle_us, "Default inter-byte read timeout in microseconds for new opens (0 = return at once)");
+
+static bool use_tty;
+module_param_named(tty, use_tty, bool, 0444);
+MODULE_PARM_DESC(tty, "Register the Mini UART with serial_core as a tty instead of the misc device");
+
+static bool use_rtscts;
+module_param_named(rtscts, use_rtscts, bool, 0444);
+MODULE_PARM_DESC(rtscts, "Mini UART hardware flow control, CTS on GPIO16 and RTS on GPIO17 (default off)");
+
+static unsigned int rts_level = 4;
+module_param(rts_level, uint, 0444);
+MODULE_PARM_DESC(rts_level, "With rtscts=1, de-assert RTS once only this many RX FIFO slots (1-4) are free (default 4)");
+
+// Adaptive RX polling of the Mini UART, tunable at run time through
+// /sys/module/rpi_uart/parameters
+static unsigned int rx_poll_irqs = 16;
+module_param(rx_poll_irqs, uint, 0644);
+MODULE_PARM_DESC(rx_poll_irqs, "Mini UART RX interrupts per millisecond that switch to polling (0 = never poll, default 16)");
+
+static unsigned int rx_poll_us;
+module_param(rx_poll_us, uint, 0644);
+MODULE_PARM_DESC(rx_poll_us, "Mini UART RX poll period in microseconds (0 = time to fill 6 FIFO slots at the baud rate)");
+
+static unsigned int rx_poll_budget = 256;
+module_param(rx_poll_budget, uint, 0644);
+MODULE_PARM_DESC(rx_poll_budget, "Most bytes drained per Mini UART RX poll (default 256)");
+
+static unsigned int rx_poll_idle = 8;
+module_param(rx_poll_idle, uint, 0644);
+MODULE_PARM_DESC(rx_poll_idle, "Empty Mini UART RX polls before the RX interrupt is re-enabled (default 8)");
+
+static unsigned int tx_zerocopy;
+module_param(tx_zerocopy, uint, 0644);
+MODULE_PARM_DESC(tx_zerocopy, "Send raw blocking writes of at least this many bytes from the pinned user pages, without a copy (0 = off, default)");
+
+static unsigned int atomic_write = 1024;
+module_param(atomic_write, uint, 0644);
+MODULE_PARM_DESC(atomic_write, "Writes up to this many bytes are queued whole, never interleaved with other writers (at most half the TX ring, default 1024)");
+
+static int autosuspend_ms = -1;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle milliseconds before the Mini UART clock is gated, -1 = never (default); later through the device's power/autosuspend_delay_ms");
+
+static bool banner = true;
+module_param(banner, bool, 0644);
+MODULE_PARM_DESC(banner, "Send load/unload banners on misc device ports (default on)");
+
+static bool use_mini = true;
+module_param_named(mini, use_mini, bool, 0444);
+MODULE_PARM_DESC(mini, "Bind to the Mini UART (brcm,bcm2835-aux-uart) in device tree as /dev/ttyMU0 (default on)");
+
+static int pl011_ports[PL011_MAX_PORTS];
+static unsigned int num_pl011;
+module_param_array_named(pl011, pl011_ports, int, &num_pl011, 0444);
+MODULE_PARM_DESC(pl011, "Also drive these PL011 UARTs (0, 2-5) as /dev/ttyPLn, e.g. pl011=2,3,4,5; uses DMA when device tree provides it; UART0 needs mini=0 unless the Mini UART is on other pins");
+
+static int irq_cpus[UART_MAX_PORTS] = { [0 ... UART_MAX_PORTS - 1] = -1 };
+static unsigned int num_irq_cpus;
+module_param_array_named(irq_cpu, irq_cpus, int, &num_irq_cpus, 0444);
+MODULE_PARM_DESC(irq_cpu, "CPU for each port's interrupt: Mini UART first, then the pl011= ports in order, -1 = not pinned; ports sharing an IRQ line need the same CPU");
+
+// Pin settings of one port, collected first and then written with a
+// single read-modify-write per register
+struct uart_gpio_batch {
+    u32 fsel_mask[GPIO_FSEL_REGS];
+    u32 fsel[GPIO_FSEL_REGS];
+    u32 pull_mask[GPIO_PULL_REGS];
+    u32 pull[GPIO_PULL_REGS];
+};
+
+static void uart_gpio_add(struct uart_gpio_batch *b, unsigned int pin, u32 fsel, u32 pull)
+{
+    unsigned int shift = (pin % 10) * 3;
+
+    b->fsel_mask[pin / 10] |= 7 << shift;
+    b->fsel[pin / 10] |= fsel << shift;
 
-// Delay function for GPIO setup 
-static void delay_cycles(int count)
+    shift = (pin % 16) * 2;
+    b->pull_mask[pin / 16] |= 3 << shift;
+    b->pull[pin / 16] |= pull << shift;
+}
+
+// Pins are only muxed here when device tree has no pinctrl state for the
+// port. The pinctrl driver's own lock is out of reach, so this keeps each
+// write back-to-back with its read. The Mini UART and PL011 ports all go
+// through uart_gpio_lock. Neither GPFSEL nor GPPUPPDN needs settling
+// time, and on BCM2835/7 the pulls are left alone.
+static void uart_gpio_apply(const struct uart_gpio_batch *b)
 {
-    while (count--) {
-        cpu_relax();  //Linux function that tells the CPU "take a tiny break"
+    unsigned long flags;
+    void __iomem *reg;
+    unsigned int i;
+
+    spin_lock_irqsave(&uart_gpio_lock, flags);
+
+    for (i = 0; i < GPIO_FSEL_REGS; i++) {
+        if (b->fsel_mask[i]) {
+            reg = gpio + GPFSEL0 + i * 4;
+            writel((readl(reg) & ~b->fsel_mask[i]) | b->fsel[i], reg);
+        }
+    }
+
+    for (i = 0; gpio_has_pupdn && i < GPIO_PULL_REGS; i++) {
+        if (b->pull_mask[i]) {
+            reg = gpio + GPPUPPDN0 + i * 4;
+            writel((readl(reg) & ~b->pull_mask[i]) | b->pull[i], reg);
+        }
     }
+
+    spin_unlock_irqrestore(&uart_gpio_lock, flags);
 }
 
-// Initialize Mini UART - following your bare metal sequence 
-static void uart_init_os(void)
+// Program MU_BAUD from the current core clock:
+// baud = clock / (8 * (reg + 1)), reg is 16 bits wide
+static int uart_set_baud(struct uart_dev *ud, u32 baudrate)
 {
-    u32 val;
-    void __iomem *gpfsel1;  // Pointer to GPIO Function Select register
-    void __iomem *gppuppdn0;  // Pointer to GPIO Pull-up/down register
+    unsigned long clock = READ_ONCE(ud->clock_rate);
+    unsigned long flags;
+    unsigned long reg;
     
-    // Configure GPIO14 and GPIO15 for Mini UART (ALT5) 
-    gpfsel1 = gpio + GPFSEL1;
-    val = readl(gpfsel1);
-    val &= ~((7 << 12) | (7 << 15));  // Clear both GPIO14 and GPIO15 bits
-    val |= (GPIO_FSEL_ALT5 << 12) | (GPIO_FSEL_ALT5 << 15);  // Set both to ALT5
-    writel(val, gpfsel1);
-
+    if (baudrate == 0 || baudrate > clock / 8) {
+        return -EINVAL;
+    }
+    
+    reg = DIV_ROUND_CLOSEST(clock, 8UL * baudrate) - 1;
+    if (reg > 0xFFFF) {
+        return -EINVAL;
+    }
+    
+    // Runtime resume programs it from ud->baud
+    spin_lock_irqsave(&ud->lock, flags);
+    if (!ud->suspended) {
+        writel(reg, &ud->regs->MU_BAUD);
+    }
+    ud->baud = baudrate;
+    spin_unlock_irqrestore(&ud->lock, flags);
     
-    gppuppdn0 = gpio + GPPUPPDN0;
-    val = readl(gppuppdn0);
-    val &= ~((0x3 << 28) | (0x3 << 30));  // Clear both GPIO14 and GPIO15 bits 
-    val |= (GPIO_PUPDN_NONE << 28) | (GPIO_PUPDN_UP << 30);  // Set both values 
-    writel(val, gppuppdn0);
+    return 0;
+}
 
+// baud= can be changed at runtime through /sys/module/.../parameters/baud,
+// it applies to every port not owned by the tty layer. All of them or
+// none: if one port cannot do the rate, those already switched go back.
+static int uart_baud_param_set(const char *val, const struct kernel_param *kp)
+{
+    u32 old[UART_MAX_PORTS];
+    struct uart_dev *ud;
+    unsigned int i;
+    u32 baudrate;
+    int ret;
     
-    //Wait for GPIO configuration to settle 
-    delay_cycles(150);
+    ret = kstrtou32(val, 0, &baudrate);
+    if (ret) {
+        return ret;
+    }
+    
+    // Ports probed later pick the value up from uart_baud
+    mutex_lock(&uart_devs_lock);
+    for (i = 0; i < UART_MAX_PORTS; i++) {
+        ud = uart_devs[i];
+
+        // The tty layer owns the line settings, use termios instead
+        if (!ud || ud->tty) {
+            continue;
+        }
+
+        old[i] = READ_ONCE(ud->baud);
+        ret = ud->backend->set_baud(ud, baudrate);
+        if (ret) {
+            break;
+        }
+    }
+
+    if (ret) {
+        // The old rates worked a moment ago
+        while (i--) {
+            ud = uart_devs[i];
+            if (ud && !ud->tty) {
+                ud->backend->set_baud(ud, old[i]);
+            }
+        }
+    } else {
+        uart_baud = baudrate;
+    }
+    mutex_unlock(&uart_devs_lock);
+
+    return ret;
+}
+
+static const struct kernel_param_ops uart_baud_param_ops = {
+    .set = uart_baud_param_set,
+    .get = param_get_uint,
+};
+
+module_param_cb(baud, &uart_baud_param_ops, &uart_baud, 0644);
+MODULE_PARM_DESC(baud, "Line speed in baud of all ports (default 9600)");
+
+// Keep the line speed when the UART clock is rescaled
+static int uart_clk_notify(struct notifier_block *nb, unsigned long event, void *data)
+{
+    struct uart_dev *ud = container_of(nb, struct uart_dev, clk_nb);
+    struct clk_notifier_data *cnd = data;
     
-    // Enable Mini UART in AUX enables register 
-    val = readl(&uart->ENABLES);
-    writel(val | 0x1, &uart->ENABLES);
+    if (event != POST_RATE_CHANGE) {
+        return NOTIFY_DONE;
+    }
     
-    // Disable TX/RX during configuration
-    writel(0x0, &uart->MU_CNTL);
+    WRITE_ONCE(ud->clock_rate, cnd->new_rate);
+    if (ud->tty) {
+        ud->port.uartclk = cnd->new_rate;
+    }
     
-    //  Disable interrupts 
-    writel(0x0, &uart->MU_IER);
+    if (ud->backend->set_baud(ud, ud->baud)) {
+        pr_warn("%s: %u baud not reachable at %lu Hz clock\n",
+                ud->name, ud->baud, cnd->new_rate);
+    }
     
-    // Clear FIFOs
-    // Clear RX FIFO
-    writel(0x02, &uart->MU_IIR);  // Bit 1 set (01 in bits 2:1)
+    return NOTIFY_OK;
+}
 
-    // Clear TX FIFO  
-    writel(0x04, &uart->MU_IIR);  // Bit 2 set (10 in bits 2:1)
+// Use the UART clock from device tree so the divisor follows the real
+// clock rate. Without one the backend's nominal ud->clock_rate is kept.
+static void uart_get_clock(struct uart_dev *ud, struct clk *clk)
+{
+    if (IS_ERR(clk)) {
+        pr_warn("%s: no clock in device tree, assuming %lu Hz\n", ud->name, ud->clock_rate);
+        return;
+    }
+    
+    if (clk_prepare_enable(clk)) {
+        clk_put(clk);
+        return;
+    }
+    
+    ud->clk = clk;
+    ud->clock_rate = clk_get_rate(clk);
+    
+    ud->clk_nb.notifier_call = uart_clk_notify;
+    if (clk_notifier_register(clk, &ud->clk_nb)) {
+        pr_warn("%s: cannot follow clock rate changes\n", ud->name);
+        ud->clk_nb.notifier_call = NULL;
+    }
+}
 
+static void uart_put_clock(struct uart_dev *ud)
+{
+    if (!ud->clk) {
+        return;
+    }
     
+    if (ud->clk_nb.notifier_call) {
+        clk_notifier_unregister(ud->clk, &ud->clk_nb);
+    }
+    clk_disable_unprepare(ud->clk);
+    clk_put(ud->clk);
+    ud->clk = NULL;
+}
+
+// MU_CNTL with TX and RX enabled. With auto flow control the receiver
+// drops RTS as the RX FIFO fills and the transmitter pauses while CTS is
+// de-asserted, so the 8-byte FIFO cannot overrun however late the
+// interrupt is serviced.
+static u32 uart_mini_cntl(bool autoflow)
+{
+    u32 cntl = MU_CNTL_RX_EN | MU_CNTL_TX_EN;
+
+    if (autoflow) {
+        cntl |= MU_CNTL_RX_AUTOFLOW | MU_CNTL_TX_AUTOFLOW |
+                MU_CNTL_RTS_LEVEL(clamp_val(rts_level, 1, 4));
+    }
+
+    return cntl;
+}
+
+// Line format, baud rate and enables, with TX/RX disabled. Also used by
+// runtime resume, the clock gate does not keep them.
+static int uart_mini_config(struct uart_dev *ud)
+{
+    struct uart_regs __iomem *uart = ud->regs;
+    int ret;
+
     // Set data format to 8-bit mode 
     writel(0x3, &uart->MU_LCR);  // 8-bit mode 
     
     // Disable 
     writel(0x0, &uart->MU_MCR);
     
-    // baud rate 9600 
-    u16 baud_val = (500000000/(9600*8))-1;  
-    writel(baud_val, &uart->MU_BAUD);
+    // Baud rate from the baud= parameter
+    ret = uart_set_baud(ud, ud->baud);
+    if (ret) {
+        return ret;
+    }
     
-    // Enable TX and RX 
-    writel(0x3, &uart->MU_CNTL);  // Enable TX and RX 
+    // Enable TX and RX, with RTS/CTS flow control if rtscts=1
+    writel(uart_mini_cntl(ud->rtscts), &uart->MU_CNTL);
     
     // Memory barrier to ensure all writes complete 
     wmb();
-    
-    pr_info("Mini UART initialized successfully\n");
+    return 0;
 }
 
-// Send a single char blocking
-static void uart_send_char(char c)
+// Initialize Mini UART - following your bare metal sequence 
+static int uart_init_os(struct uart_dev *ud)
 {
-    // Handle newline 
-    if (c == '\n') {
-        uart_send_char('\r');
-    }
+    struct uart_regs __iomem *uart = ud->regs;
+    struct uart_gpio_batch pins = { };
+    int ret;
     
-    // Wait until TX FIFO has space 
-    while (!(readl(&uart->MU_LSR) & (1 << 5))) {
-        /* spin wait */
+    // Otherwise the driver core has already applied the node's pinctrl state
+    if (ud->mux_pins) {
+        // TXD1 on GPIO14 and RXD1 on GPIO15 (ALT5), RX pulled up
+        uart_gpio_add(&pins, 14, GPIO_FSEL_ALT5, GPIO_PUPDN_NONE);
+        uart_gpio_add(&pins, 15, GPIO_FSEL_ALT5, GPIO_PUPDN_UP);
+
+        // CTS1 on GPIO16 and RTS1 on GPIO17 (ALT5), CTS pulled up so an
+        // unconnected line holds TX off instead of floating
+        if (ud->rtscts) {
+            uart_gpio_add(&pins, 16, GPIO_FSEL_ALT5, GPIO_PUPDN_UP);
+            uart_gpio_add(&pins, 17, GPIO_FSEL_ALT5, GPIO_PUPDN_NONE);
+        }
+
+        uart_gpio_apply(&pins);
     }
+
+    // The Mini UART bit in AUX_ENABLES is the gate of its clock, which
+    // probe has already enabled
+
+    // Disable TX/RX during configuration
+    writel(0x0, &uart->MU_CNTL);
     
-    // Write character to TX FIFO (only lower 8 bits) 
-    writel((u32)(c & 0xFF), &uart->MU_IO);
-}
+    //  Disable interrupts 
+    writel(0x0, &uart->MU_IER);
+    
+    // Clear FIFOs
+    // Clear RX FIFO
+    writel(0x02, &uart->MU_IIR);  // Bit 1 set (01 in bits 2:1)
 
-// Send a string
-static void uart_send_string(const char *s)
-{
-    while (*s) {
-        if (*s == '\n') {
-            uart_send_char('\r');  //  carriage return before newline 
-        }
-        uart_send_char(*s++);
+    // Clear TX FIFO  
+    writel(0x04, &uart->MU_IIR);  // Bit 2 set (10 in bits 2:1)
+
+    ret = uart_mini_config(ud);
+    if (ret) {
+        pr_err("Unsupported baud rate %u\n", ud->baud);
+        return ret;
     }
+    
+    pr_info("Mini UART initialized successfully at %u baud\n", ud->baud);
+    return 0;
 }
 
-// Check if data is available to receive
-static int uart_data_available(void)
+// Free slots in the TX FIFO - one MMIO read covers a whole burst
+static unsigned int uart_tx_fifo_room(struct uart_dev *ud)
 {
-    return (readl(&uart->MU_LSR) & (1 << 0));  // Bit 0 = data ready
+    return MU_FIFO_DEPTH - MU_STAT_TX_LEVEL(readl(&ud->regs->MU_STAT));
 }
 
-// Receive a single character (non-blocking)
-static char uart_receive_char(void)
+// Write n bytes into the TX FIFO with no per-byte status check,
+// the caller has made sure there is room for them
+static void uart_tx_burst(struct uart_dev *ud, const char *s, unsigned int n)
 {
-    if (!uart_data_available()) {
-        return 0;  // No data available
-    }
+    unsigned int i;
     
-    return (char)(readl(&uart->MU_IO) & 0xFF);
+    for (i = 0; i < n; i++) {
+        writel((u32)(s[i] & 0xFF), &ud->regs->MU_IO);
+    }
 }
 
-// Proc file read handler for receiving data
-static ssize_t uart_proc_read(struct file *file, char __user *buf, 
-                              size_t count, loff_t *ppos)
+// Pull everything currently in the RX FIFO into buf (MU_FIFO_DEPTH
+// bytes), one MU_STAT read for the whole burst. Used by both front ends.
+static unsigned int uart_rx_drain(struct uart_dev *ud, char *buf)
 {
-    char kbuf[256];
-    int i = 0;
-    char c;
-    int consecutive_no_data = 0;
-    // At 9600 baud, each character takes ~1.04ms to transmit (10 bits total)
-    // Wait for 300ms of no data before considering transmission complete
-    // This ensures we capture all characters even with typing delays
-    const int MAX_CONSECUTIVE_NO_DATA = 300; // 300 iterations * 1ms = 300ms
-    
-    // Return 0 on second read (standard /proc behavior)
-    // This prevents the kernel from repeatedly calling our read function
-    if (*ppos > 0) {
-        return 0;
-    }
-    
-    // Wait for first character with timeout (up to 1 second)
-    int timeout = 1000;
-    while (!uart_data_available() && timeout-- > 0) {
-        udelay(1000); // Wait 1ms (1000 microseconds)
-    }
+    u32 stat = readl(&ud->regs->MU_STAT);
+    unsigned int n = MU_STAT_RX_LEVEL(stat);
+    unsigned int i;
     
-    if (timeout <= 0) {
-        return 0; // No data received
+    // The same read shows overruns, only then is MU_LSR read to clear it
+    if (unlikely(stat & MU_STAT_RX_OVERRUN)) {
+        readl(&ud->regs->MU_LSR);
+        ud->rx_err_flags |= RPI_UART_RX_ERR_OVERRUN;
     }
     
-    // Read all available characters
-    // Keep reading until buffer is full or no more data arrives for a while
-    while (i < (sizeof(kbuf) - 1) && i < count) {
-        // Read characters as fast as they arrive (drain FIFO quickly)
-        while (uart_data_available() && i < (sizeof(kbuf) - 1) && i < count) {
-            c = uart_receive_char();
-            if (c != 0) {
-                kbuf[i++] = c;
-                consecutive_no_data = 0; // Reset counter when we get data
-            }
-        }
-        
-        // If we've read some data but no more is available, wait a bit
-        if (i > 0 && !uart_data_available()) {
-            udelay(1000); // Wait 1ms
-            consecutive_no_data++;
-            
-            // If no data for MAX_CONSECUTIVE_NO_DATA iterations, 
-            // consider transmission complete
-            if (consecutive_no_data >= MAX_CONSECUTIVE_NO_DATA) {
-                break; // No more data coming
-            }
-        } else if (i == 0 && !uart_data_available()) {
-            // No data at all, wait a bit and check again
-            udelay(1000);
-            consecutive_no_data++;
-            if (consecutive_no_data >= MAX_CONSECUTIVE_NO_DATA) {
-                break;
-            }
-        }
+    for (i = 0; i < n; i++) {
+        buf[i] = (char)(readl(&ud->regs->MU_IO) & 0xFF);
     }
     
-    if (i == 0) {
-        return 0;
+    if (n) {
+        trace_rpi_uart_rx_drain(ud->name, n);
     }
     
-    kbuf[i] = '\0';
-    
-    if (copy_to_user(buf, kbuf, i)) {
-        return -EFAULT;
+    return n;
+}
+
+// The consumer index, in the shared header if userspace can map the ring.
+// Userspace may write anything there, every index is masked before use.
+static unsigned int *uart_ring_tail(struct uart_ring *r)
+{
+    return r->shared ? &r->shared->tail : &r->tail;
+}
+
+// Bytes between tail and head. A mapped tail may have been set more than
+// size behind head (or ahead of it), that counts as a full ring.
+static unsigned int uart_ring_used(struct uart_ring *r, unsigned int head, unsigned int tail)
+{
+    return min(head - tail, r->size);
+}
+
+// Publish bytes written up to head (producer side)
+static void uart_ring_set_head(struct uart_ring *r, unsigned int head)
+{
+    smp_store_release(&r->head, head);
+    if (r->shared) {
+        smp_store_release(&r->shared->head, head);
     }
-    
-    *ppos += i;  // Update file position - critical for preventing repeated reads
-    
-    pr_info("UART RX: received %d bytes: %s\n", i, kbuf);
-    return i;
 }
 
-// Proc file write handler for transmitting data
-static ssize_t uart_proc_write(struct file *file,
-    const char __user *buf, size_t count, loff_t *ppos)
+// Bytes currently queued in the ring (consumer side)
+static unsigned int uart_ring_count(struct uart_ring *r)
 {
-    char kbuf[256];
-    size_t len;
-    
-    // Limit the size to prevent buffer overflow 
-    len = min(count, sizeof(kbuf) - 1);
-    
-    if (copy_from_user(kbuf, buf, len)) {
-        return -EFAULT;
+    return uart_ring_used(r, smp_load_acquire(&r->head), READ_ONCE(*uart_ring_tail(r)));
+}
+
+// Queue one byte (producer side), returns false if the ring is full
+static bool uart_ring_put(struct uart_ring *r, char c)
+{
+    unsigned int head = r->head;
+
+    if (uart_ring_used(r, head, smp_load_acquire(uart_ring_tail(r))) >= r->size) {
+        return false;
     }
-    
-    kbuf[len] = '\0';
-    
-    // Send the string via UART 
-    uart_send_string(kbuf);
-    
-    pr_info("UART TX: sent %zu bytes\n", len);
-    
-    return count;
+
+    r->buf[head & (r->size - 1)] = c;
+    uart_ring_set_head(r, head + 1);
+    return true;
 }
 
-// Proc operations for TX (write to send data)
-static const struct proc_ops uart_tx_proc_ops = {
-    .proc_write = uart_proc_write,   
-};
+// Queue up to len bytes (producer side), returns the number stored
+static unsigned int uart_ring_put_many(struct uart_ring *r, const char *src, unsigned int len)
+{
+    unsigned int head = r->head;
+    unsigned int n = min(len, r->size - uart_ring_used(r, head, smp_load_acquire(uart_ring_tail(r))));
+    unsigned int i;
 
-// Proc operations for RX (read to receive data)
-static const struct proc_ops uart_rx_proc_ops = {
-    .proc_read = uart_proc_read,
-};
+    for (i = 0; i < n; i++) {
+        r->buf[(head + i) & (r->size - 1)] = src[i];
+    }
 
-// Module initialization 
-static int __init uart_driver_init(void)
+    uart_ring_set_head(r, head + n);
+    return n;
+}
+
+// Free space in the ring (producer side)
+static unsigned int uart_ring_space(struct uart_ring *r)
 {
-    // Map GPIO registers 
-    gpio = ioremap(GPIO_BASE, 0x1000);
-    if (!gpio) {
-        pr_err("Failed to map GPIO registers\n");
-        return -ENOMEM;
+    return r->size - uart_ring_used(r, r->head, smp_load_acquire(uart_ring_tail(r)));
+}
+
+// Dequeue up to len bytes (consumer side), returns the number copied.
+// A tail out of range is pulled back to the oldest byte still stored.
+static unsigned int uart_ring_get(struct uart_ring *r, char *dst, unsigned int len)
+{
+    unsigned int head = smp_load_acquire(&r->head);
+    unsigned int tail = READ_ONCE(*uart_ring_tail(r));
+    unsigned int n;
+    unsigned int i;
+
+    if (head - tail > r->size) {
+        tail = head - r->size;
     }
-    
-    // Map UART registers 
-    uart = ioremap(AUX_BASE, sizeof(struct uart_regs));
-    if (!uart) {
-        pr_err("Failed to map UART registers\n");
-        iounmap(gpio);
-        return -ENOMEM;
+    n = min(len, head - tail);
+
+    for (i = 0; i < n; i++) {
+        dst[i] = r->buf[(tail + i) & (r->size - 1)];
     }
-    
-    // Initialize the Mini UART 
-    uart_init_os();
-    
-    // Create /proc/uart_tx file for transmitting data
-    proc_tx = proc_create(PROC_UART_TX, 0666, NULL, &uart_tx_proc_ops); 
-    if (!proc_tx) {
-        pr_err("Failed to create /proc/%s\n", PROC_UART_TX);
-        iounmap(uart);
-        iounmap(gpio);
-        return -ENOMEM;
+
+    smp_store_release(uart_ring_tail(r), tail + n);
+    return n;
+}
+
+// Record the frame boundaries in n bytes just stored at ring position
+// pos (RX path). Returns the number of frames completed.
+static unsigned int uart_frame_scan(struct uart_dev *ud, u32 framing,
+                                    const char *buf, unsigned int n, unsigned int pos)
+{
+    u8 delim = UART_FRAMING_DELIM(framing);
+    unsigned int head = ud->frame_head;
+    unsigned int frames = 0;
+    unsigned int i;
+
+    // Mode changed - bytes before this point belong to the first frame
+    if (framing != ud->frame_seen) {
+        ud->frame_seen = framing;
+        ud->frame_len = 0;
     }
-    
-    // Create /proc/uart_rx file for receiving data
-    proc_rx = proc_create(PROC_UART_RX, 0666, NULL, &uart_rx_proc_ops);
-    if (!proc_rx) {
-        pr_err("Failed to create /proc/%s\n", PROC_UART_RX);
-        proc_remove(proc_tx);
-        iounmap(uart);
-        iounmap(gpio);
-        return -ENOMEM;
+
+    for (i = 0; i < n; i++) {
+        if ((u8)buf[i] != delim) {
+            // A frame as big as the ring could never complete, cut it so
+            // the reader can drop it
+            if (++ud->frame_len < ud->rx_ring.size) {
+                continue;
+            }
+        } else if (!ud->frame_len) {
+            continue;  // Empty frame, the reader skips its delimiter
+        }
+
+        ud->frame_len = 0;
+        if (head - smp_load_acquire(&ud->frame_tail) >= UART_RX_FRAMES) {
+            continue;  // Index full after a mode switch, frames merge
+        }
+        ud->frame_end[head++ & (UART_RX_FRAMES - 1)] = pos + i + 1;
+        frames++;
     }
-    
-    // Send a test message 
-    uart_send_string("Mini UART driver loaded successfully!\r\n");
-    
-    pr_info("UART driver loaded.\n");
-    pr_info("Write to /proc/%s to send data\n", PROC_UART_TX);
-    pr_info("Read from /proc/%s to receive data\n", PROC_UART_RX);
-    return 0;
+
+    smp_store_release(&ud->frame_head, head);
+    this_cpu_add(ud->stats->rx_frames, frames);
+    return frames;
 }
 
-// Module cleanup
-static void __exit uart_driver_exit(void)
+// End of the oldest complete frame not yet read (reader side). Entries left
+// over from stream mode reads are skipped.
+static bool uart_frame_next(struct uart_dev *ud, unsigned int *end)
 {
-    uart_send_string("Mini UART driver unloading...\r\n");
-    
-    // Remove proc entries
-    proc_remove(proc_tx);
-    proc_remove(proc_rx);
-    
-    // Unmap registers 
-    if (uart)
-        iounmap(uart);
-    if (gpio)
-        iounmap(gpio);
-    
+    unsigned int tail = ud->frame_tail;
+    unsigned int rx_tail = READ_ONCE(*uart_ring_tail(&ud->rx_ring));
+
+    while (tail != smp_load_acquire(&ud->frame_head)) {
+        *end = ud->frame_end[tail & (UART_RX_FRAMES - 1)];
+        if ((int)(*end - rx_tail) > 0) {
+            smp_store_release(&ud->frame_tail, tail);
+            return true;
+        }
+        tail++;
+    }
+
+    smp_store_release(&ud->frame_tail, tail);
+    return false;
+}
+
+static void uart_frame_pop(struct uart_dev *ud)
+{
+    smp_store_release(&ud->frame_tail, ud->frame_tail + 1);
+}
+
+// Whether a complete frame is waiting, for wait conditions and poll
+static bool uart_frame_ready(struct uart_dev *ud)
+{
+    unsigned int end;
+    bool ready;
+
+    spin_lock(&ud->rx_lock);
+    ready = uart_frame_next(ud, &end);
+    spin_unlock(&ud->rx_lock);
+
+    return ready;
+}
+
+// Dequeue the oldest complete frame including its delimiter, in one step
+// so concurrent readers each get whole frames. dst holds rx_ring.size
+// bytes. Returns its length, 0 = none, and its ring position in *pos.
+static unsigned int uart_frame_take(struct uart_dev *ud, char *dst, unsigned int *pos)
+{
+    unsigned int end;
+    unsigned int len = 0;
+
+    spin_lock(&ud->rx_lock);
+    while (uart_frame_next(ud, &end)) {
+        *pos = READ_ONCE(*uart_ring_tail(&ud->rx_ring));
+        uart_frame_pop(ud);
+
+        // No frame is longer than the ring, so a tail this far behind was
+        // written through the mapping. Drop the frame and resync at its end.
+        if (end - *pos > ud->rx_ring.size) {
+            smp_store_release(uart_ring_tail(&ud->rx_ring), end);
+            this_cpu_inc(ud->stats->rx_bad_frames);
+            continue;
+        }
+
+        len = uart_ring_get(&ud->rx_ring, dst, end - *pos);
+        break;
+    }
+    spin_unlock(&ud->rx_lock);
+
+    return len;
+}
+
+// Record when n bytes stored at ring position pos came from the hardware
+// (RX path)
+static void uart_rx_stamp(struct uart_dev *ud, unsigned int pos, unsigned int n)
+{
+    struct rpi_uart_ring_header *hdr = ud->rx_ring.shared;
+    unsigned int head = hdr->stamp_head;
+    struct rpi_uart_rx_stamp *s = &ud->rx_stamps[head & (UART_RX_STAMPS - 1)];
+
+    WRITE_ONCE(s->ns, ktime_get_raw_ns());
+    WRITE_ONCE(s->pos, pos);
+    WRITE_ONCE(s->len, n);
+    smp_store_release(&hdr->stamp_head, head + 1);
+}
+
+// Find the timestamp of the byte at ring position pos (reader side).
+// Leaves ns 0 if its record has been overwritten.
+static void uart_rx_stamp_find(struct uart_dev *ud, unsigned int pos,
+                               struct rpi_uart_rx_stamp *out)
+{
+    struct rpi_uart_ring_header *hdr = ud->rx_ring.shared;
+    unsigned int head = smp_load_acquire(&hdr->stamp_head);
+    unsigned int i = head - min_t(unsigned int, head, UART_RX_STAMPS);
+    struct rpi_uart_rx_stamp *s;
+
+    memset(out, 0, sizeof(*out));
+
+    // Oldest first, unread data is usually in the older records
+    for (; i != head; i++) {
+        s = &ud->rx_stamps[i & (UART_RX_STAMPS - 1)];
+        out->pos = READ_ONCE(s->pos);
+        out->len = READ_ONCE(s->len);
+        if (pos - out->pos < out->len) {
+            out->ns = READ_ONCE(s->ns);
+            break;
+        }
+    }
+
+    // The RX path may have reused the record meanwhile
+    smp_rmb();
+    if (i == head || READ_ONCE(hdr->stamp_head) - i > UART_RX_STAMPS) {
+        memset(out, 0, sizeof(*out));
+    }
+}
+
+// Record line errors the UART flagged in the bytes pushed last (RX
+// path). Errors are rare, so this may take rx_err_lock and wake pollers;
+// callers may hold ud->lock.
+static void uart_rx_error(struct uart_dev *ud, u32 err)
+{
+    struct rpi_uart_rx_errors *e = &ud->rx_err;
+    unsigned long flags;
+
+    if (err & RPI_UART_RX_ERR_OVERRUN) {
+        this_cpu_inc(ud->stats->rx_overruns);
+    }
+    if (err & RPI_UART_RX_ERR_FRAMING) {
+        this_cpu_inc(ud->stats->rx_framing_errors);
+    }
+    if (err & RPI_UART_RX_ERR_PARITY) {
+        this_cpu_inc(ud->stats->rx_parity_errors);
+    }
+    if (err & RPI_UART_RX_ERR_BREAK) {
+        this_cpu_inc(ud->stats->rx_breaks);
+    }
+
+    spin_lock_irqsave(&ud->rx_err_lock, flags);
+    e->pos = ud->rx_ring.head;
+    e->last = err;
+    e->overrun += !!(err & RPI_UART_RX_ERR_OVERRUN);
+    e->framing += !!(err & RPI_UART_RX_ERR_FRAMING);
+    e->parity += !!(err & RPI_UART_RX_ERR_PARITY);
+    e->brk += !!(err & RPI_UART_RX_ERR_BREAK);
+    WRITE_ONCE(e->events, e->events + 1);
+    spin_unlock_irqrestore(&ud->rx_err_lock, flags);
+
+    wake_up_interruptible_poll(&ud->rx_wait, EPOLLPRI);
+}
+
+// Hand received bytes to readers (backend side of rx_ring)
+static void uart_rx_push(struct uart_dev *ud, const char *buf, unsigned int n)
+{
+    u32 framing = READ_ONCE(ud->framing);
+    unsigned int pos = ud->rx_ring.head;
+    unsigned int stored;
+    bool wake;
+
+    if (!n) {
+        return;
+    }
+
+    if (ud->pm) {
+        pm_runtime_mark_last_busy(ud->dev);
+    }
+
+    stored = uart_ring_put_many(&ud->rx_ring, buf, n);
+    if (stored) {
+        uart_rx_stamp(ud, pos, stored);
+    }
+    this_cpu_add(ud->stats->rx_bytes, stored);
+    if (stored < n) {
+        this_cpu_add(ud->stats->rx_dropped, n - stored);
+    }
+    uart_stat_max(ud, rx_high, ud->rx_ring.size - uart_ring_space(&ud->rx_ring));
+    trace_rpi_uart_rx_enqueue(ud->name, stored, ud->rx_ring.size - uart_ring_space(&ud->rx_ring));
+
+    // Packet mode readers only care about complete frames
+    if (UART_FRAMING_MODE(framing) != RPI_UART_FRAME_NONE) {
+        wake = uart_frame_scan(ud, framing, buf, stored, pos);
+    } else {
+        wake = stored;
+    }
+
+    if (wake) {
+        wake_up_interruptible(&ud->rx_wait);
+    }
+
+    // A kernel consumer takes the bytes instead of readers
+    if (stored && READ_ONCE(ud->client)) {
+        queue_work(system_highpri_wq, &ud->client_work);
+    }
+
+    if (unlikely(ud->rx_err_flags)) {
+        uart_rx_error(ud, ud->rx_err_flags);
+        ud->rx_err_flags = 0;
+    }
+}
+
+// TX ring space was handed back (backend side of tx_ring): wake writers
+// and let client_work complete rpi_uart_submit_tx() buffers
+static void uart_tx_freed(struct uart_dev *ud)
+{
+    // wake_up(), the zero-copy writer sleeps killable
+    wake_up(&ud->tx_wait);
+
+    // Pairs with rpi_uart_submit_tx(): the tail update is seen there, or
+    // the new request here
+    smp_mb();
+    if (READ_ONCE(ud->tx_req_head) != READ_ONCE(ud->tx_req_tail)) {
+        queue_work(system_highpri_wq, &ud->client_work);
+    }
+}
+
+// Bytes of a zero-copy write not yet taken by the TX path, ud->lock held
+static bool uart_tx_zc_pending(struct uart_dev *ud)
+{
+    return ud->tx_zc && ud->tx_zc->pos < ud->tx_zc->len;
+}
+
+// Anything left for the TX path, ud->lock held
+static bool uart_tx_pending(struct uart_dev *ud)
+{
+    return uart_ring_count(&ud->tx_ring) || uart_tx_zc_pending(ud);
+}
+
+// Copy up to len bytes of the zero-copy write straight from its pages
+// into a FIFO burst, ud->lock held. The TX ring, drained first, is held
+// empty by the writer.
+static unsigned int uart_tx_zc_get(struct uart_dev *ud, char *dst, unsigned int len)
+{
+    struct uart_tx_zc *zc = ud->tx_zc;
+    unsigned int done = 0;
+    size_t off, n;
+
+    if (!zc) {
+        return 0;
+    }
+
+    while (done < len && zc->pos < zc->len) {
+        off = zc->offset + zc->pos;
+        n = min3((size_t)(len - done), zc->len - zc->pos, PAGE_SIZE - offset_in_page(off));
+        memcpy_from_page(dst + done, zc->pages[off / PAGE_SIZE], offset_in_page(off), n);
+        done += n;
+        WRITE_ONCE(zc->pos, zc->pos + n);
+    }
+
+    return done;
+}
+
+// Update the interrupt enables, callable from any context
+static void uart_set_ier(struct uart_dev *ud, u32 set, u32 clear)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&ud->lock, flags);
+    ud->ier = (ud->ier & ~clear) | set;
+    if (!ud->suspended) {
+        writel(ud->ier, &ud->regs->MU_IER);
+    }
+    spin_unlock_irqrestore(&ud->lock, flags);
+}
+
+// Make sure the TX interrupt is enabled so queued bytes go out. While
+// the clock is gated the bit waits in the shadow until resume.
+static void uart_start_tx(struct uart_dev *ud)
+{
+    unsigned long flags;
+
+    // Checked under the lock uart_tx_chars() clears the bit with: it
+    // either sees the bytes just queued, or the bit is seen clear here
+    spin_lock_irqsave(&ud->lock, flags);
+    if (!(ud->ier & MU_IER_TX_IRQ)) {
+        ud->ier |= MU_IER_TX_IRQ;
+        if (!ud->suspended) {
+            writel(ud->ier, &ud->regs->MU_IER);
+        }
+    }
+    spin_unlock_irqrestore(&ud->lock, flags);
+
+    if (!ud->pm) {
+        return;
+    }
+
+    pm_runtime_mark_last_busy(ud->dev);
+    if (READ_ONCE(ud->suspended)) {
+        pm_request_resume(ud->dev);
+    }
+}
+
+// Refill the TX FIFO from the ring, called from the interrupt handler
+static void uart_tx_chars(struct uart_dev *ud)
+{
+    unsigned int sent = 0;
+    unsigned int room;
+    bool idle = false;
+    char burst[MU_FIFO_DEPTH];
+
+    spin_lock(&ud->lock);
+
+    if (ud->ier & MU_IER_TX_IRQ) {
+        // Check the FIFO level once and fill all free slots
+        room = uart_tx_fifo_room(ud);
+        sent = uart_ring_get(&ud->tx_ring, burst, room);
+        sent += uart_tx_zc_get(ud, burst + sent, room - sent);
+        uart_tx_burst(ud, burst, sent);
+        this_cpu_add(ud->stats->tx_bytes, sent);
+        trace_rpi_uart_tx_dequeue(ud->name, sent, uart_ring_count(&ud->tx_ring));
+
+        // Nothing left to send - stop the "TX empty" interrupt.
+        // Writers re-enable it after queueing, under the same lock.
+        if (!uart_tx_pending(ud)) {
+            ud->ier &= ~MU_IER_TX_IRQ;
+            writel(ud->ier, &ud->regs->MU_IER);
+            idle = true;
+        }
+    }
+
+    spin_unlock(&ud->lock);
+
+    if (sent) {
+        uart_tx_freed(ud);
+    }
+
+    // A suspend that found TX busy is not retried by itself
+    if (idle && ud->pm) {
+        pm_runtime_mark_last_busy(ud->dev);
+        pm_request_autosuspend(ud->dev);
+    }
+}
+
+// Poll period: rx_poll_us, or the time the line needs to fill all but two
+// FIFO slots, so the next poll comes before the FIFO can overrun
+static ktime_t uart_rx_poll_period(struct uart_dev *ud)
+{
+    unsigned int us = READ_ONCE(rx_poll_us);
+
+    if (!us) {
+        us = DIV_ROUND_UP((MU_FIFO_DEPTH - 2) * 10 * USEC_PER_SEC, READ_ONCE(ud->baud));
+    }
+
+    return us_to_ktime(us);
+}
+
+// NAPI-style RX: at low rates every burst raises an interrupt. Once more
+// than rx_poll_irqs RX interrupts arrive within a millisecond, the RX
+// interrupt is turned off and an hrtimer drains the FIFO in batches, one
+// timer interrupt per several bytes instead of one per byte or two.
+static void uart_rx_adapt(struct uart_dev *ud)
+{
+    unsigned int threshold = READ_ONCE(rx_poll_irqs);
+    ktime_t now;
+
+    if (!threshold) {
+        return;
+    }
+
+    now = ktime_get();
+    if (ktime_after(now, ud->rx_irq_window)) {
+        ud->rx_irq_window = ktime_add_us(now, 1000);
+        ud->rx_irq_count = 0;
+    }
+
+    if (++ud->rx_irq_count < threshold) {
+        return;
+    }
+
+    WRITE_ONCE(ud->rx_polling, true);
+    ud->rx_poll_empty = 0;
+    uart_set_ier(ud, 0, MU_IER_RX_IRQ);
+    hrtimer_start(&ud->rx_poll_timer, uart_rx_poll_period(ud), HRTIMER_MODE_REL);
+}
+
+// Drain up to rx_poll_budget bytes, back to interrupts once the line has
+// been idle for rx_poll_idle polls
+static enum hrtimer_restart uart_rx_poll(struct hrtimer *timer)
+{
+    struct uart_dev *ud = container_of(timer, struct uart_dev, rx_poll_timer);
+    unsigned int budget = READ_ONCE(rx_poll_budget);
+    unsigned int total = 0;
+    char burst[MU_FIFO_DEPTH];
+    unsigned int n;
+
+    this_cpu_inc(ud->stats->rx_polls);
+
+    while (total < budget && (n = uart_rx_drain(ud, burst))) {
+        uart_rx_push(ud, burst, n);
+        total += n;
+    }
+
+    if (total) {
+        ud->rx_poll_empty = 0;
+    } else if (++ud->rx_poll_empty >= READ_ONCE(rx_poll_idle)) {
+        // Hand RX back to the interrupt handler, which sees rx_polling
+        // clear before it can fire again
+        WRITE_ONCE(ud->rx_polling, false);
+        ud->rx_irq_count = 0;
+        uart_set_ier(ud, MU_IER_RX_IRQ, 0);
+        return HRTIMER_NORESTART;
+    }
+
+    hrtimer_forward_now(timer, uart_rx_poll_period(ud));
+    return HRTIMER_RESTART;
+}
+
+// AUX interrupt handler - empties the RX FIFO into the ring and
+// refills the TX FIFO from the TX ring
+static irqreturn_t uart_irq_handler(int irq, void *dev_id)
+{
+    struct uart_dev *ud = dev_id;
+    char burst[MU_FIFO_DEPTH];
+    bool received = false;
+    unsigned int n;
+    u32 iir;
+
+    // The AUX interrupt line is shared with SPI1/SPI2, and with the clock
+    // gated the registers cannot be read
+    if (READ_ONCE(ud->suspended)) {
+        return IRQ_NONE;
+    }
+
+    iir = readl(&ud->regs->MU_IIR);
+    if (iir & MU_IIR_NO_IRQ) {
+        return IRQ_NONE;
+    }
+
+    trace_rpi_uart_irq(ud->name, iir);
+    this_cpu_inc(ud->stats->irqs);
+
+    // While polling, rx_poll_timer is the only RX producer
+    if (!READ_ONCE(ud->rx_polling)) {
+        while ((n = uart_rx_drain(ud, burst))) {
+            uart_rx_push(ud, burst, n);
+            received = true;
+        }
+
+        if (received) {
+            uart_rx_adapt(ud);
+        }
+    }
+
+    uart_tx_chars(ud);
+
+    return IRQ_HANDLED;
+}
+
+// Another pinned port on the same interrupt line, uart_irq_lock held
+static struct uart_dev *uart_irq_sharer(struct uart_dev *ud)
+{
+    struct uart_dev *other;
+    unsigned int i;
+
+    for (i = 0; i < UART_MAX_PORTS; i++) {
+        other = uart_irq_pinned[i];
+        if (other && other != ud && other->irq == ud->irq) {
+            return other;
+        }
+    }
+
+    return NULL;
+}
+
+// Pin the port's interrupt to its irq_cpu= CPU, so busy ports can be
+// spread over the cores. Only ports with an interrupt of their own
+// scale that way: the BCM2711 PL011s share one line, and the AUX line
+// is shared with SPI1/2. Ports on one line follow the first one pinned,
+// a different CPU for a later one is refused.
+static void uart_set_irq_affinity(struct uart_dev *ud)
+{
+    struct uart_dev *other;
+
+    if (ud->irq_cpu < 0) {
+        return;
+    }
+
+    if (ud->irq_cpu >= nr_cpu_ids || !cpu_online(ud->irq_cpu)) {
+        pr_warn("%s: CPU %d is not online, IRQ %d not pinned\n",
+                ud->name, ud->irq_cpu, ud->irq);
+        return;
+    }
+
+    mutex_lock(&uart_irq_lock);
+    other = uart_irq_sharer(ud);
+    if (other && other->irq_cpu != ud->irq_cpu) {
+        pr_warn("%s: IRQ %d is shared with %s on CPU %d, ignoring irq_cpu=%d\n",
+                ud->name, ud->irq, other->name, other->irq_cpu, ud->irq_cpu);
+    } else if (!other && irq_set_affinity_and_hint(ud->irq, cpumask_of(ud->irq_cpu))) {
+        pr_warn("%s: cannot pin IRQ %d to CPU %d\n", ud->name, ud->irq, ud->irq_cpu);
+    } else {
+        uart_irq_pinned[ud->slot] = ud;
+    }
+    mutex_unlock(&uart_irq_lock);
+}
+
+// free_irq() complains about a leftover affinity hint, so it is dropped
+// before the port frees its interrupt even if another port on the line
+// still wants it. uart_repin_irq_affinity() sets it again afterwards.
+static void uart_clear_irq_affinity(struct uart_dev *ud)
+{
+    mutex_lock(&uart_irq_lock);
+    if (uart_irq_pinned[ud->slot] == ud) {
+        uart_irq_pinned[ud->slot] = NULL;
+        irq_update_affinity_hint(ud->irq, NULL);
+    }
+    mutex_unlock(&uart_irq_lock);
+}
+
+// After free_irq(): restore the hint of a port still pinned on the line
+static void uart_repin_irq_affinity(struct uart_dev *ud)
+{
+    struct uart_dev *other;
+
+    mutex_lock(&uart_irq_lock);
+    other = uart_irq_sharer(ud);
+    if (other) {
+        irq_set_affinity_and_hint(other->irq, cpumask_of(other->irq_cpu));
+    }
+    mutex_unlock(&uart_irq_lock);
+}
+
+static void uart_mini_remove(struct uart_dev *ud)
+{
+    // Disable TX/RX, devm releases the clock gate and the mapping
+    writel(0x0, &ud->regs->MU_CNTL);
+}
+
+static int uart_mini_startup(struct uart_dev *ud)
+{
+    int ret;
+    
+    hrtimer_init(&ud->rx_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ud->rx_poll_timer.function = uart_rx_poll;
+    ud->rx_polling = false;
+    
+    ret = request_irq(ud->irq, uart_irq_handler, IRQF_SHARED, "rpi_uart", ud);
+    if (ret) {
+        pr_err("Failed to request IRQ %d\n", ud->irq);
+        return ret;
+    }
+    
+    // Interrupt on received data from now on, TX is enabled on demand
+    uart_set_ier(ud, MU_IER_REQUIRED | MU_IER_RX_IRQ, 0);
+    return 0;
+}
+
+static void uart_mini_shutdown(struct uart_dev *ud)
+{
+    // Without MU_IER_REQUIRED nothing fires, even if the poll timer turns
+    // the RX bit back on, so nothing can restart the timer after this
+    uart_set_ier(ud, 0, ~0);
+    synchronize_irq(ud->irq);
+    hrtimer_cancel(&ud->rx_poll_timer);
+    free_irq(ud->irq, ud);
+}
+
+static const struct uart_backend uart_mini_backend = {
+    .name = "Mini UART",
+    .dev_name = "ttyMU%d",
+    .probe = uart_init_os,
+    .remove = uart_mini_remove,
+    .startup = uart_mini_startup,
+    .shutdown = uart_mini_shutdown,
+    .start_tx = uart_start_tx,
+    .set_baud = uart_set_baud,
+};
+
+// Mux a TX/RX pin pair (tx_pin, tx_pin + 1) to fsel, RX pulled up on BCM2711
+static void uart_gpio_setup_pair(unsigned int tx_pin, u32 fsel)
+{
+    struct uart_gpio_batch pins = { };
+
+    uart_gpio_add(&pins, tx_pin, fsel, GPIO_PUPDN_NONE);
+    uart_gpio_add(&pins, tx_pin + 1, fsel, GPIO_PUPDN_UP);
+    uart_gpio_apply(&pins);
+}
+
+// PL011 backend (pl011=n) - UART0/2-5. TX is scatter-gather DMA straight
+// out of tx_ring and RX is a cyclic DMA buffer copied into rx_ring, when
+// device tree gives the UART "tx"/"rx" dmas. Otherwise, or if a channel
+// cannot be set up, that direction falls back to interrupt-driven PIO.
+
+// The PL011 device tree node with the given register address
+static struct device_node *pl011_find_node(phys_addr_t phys)
+{
+    struct device_node *np;
+    struct resource res;
+    
+    for_each_compatible_node(np, NULL, "arm,pl011") {
+        if (!of_address_to_resource(np, 0, &res) && res.start == phys) {
+            return np;
+        }
+    }
+    
+    return NULL;
+}
+
+static void pl011_set_imsc(struct uart_dev *ud, u32 set, u32 clear)
+{
+    ud->imsc = (ud->imsc & ~clear) | set;
+    writel(ud->imsc, ud->base + PL011_IMSC);
+}
+
+// baud = clock / (16 * (IBRD + FBRD / 64))
+static int pl011_set_baud(struct uart_dev *ud, u32 baudrate)
+{
+    unsigned long clock = READ_ONCE(ud->clock_rate);
+    unsigned long flags;
+    u32 cr, fr;
+    u64 div;
+    
+    if (baudrate == 0 || baudrate > clock / 16) {
+        return -EINVAL;
+    }
+    
+    // Divisor in 1/64 steps
+    div = DIV_ROUND_CLOSEST_ULL((u64)clock * 4, baudrate);
+    if (div < 64 || (div >> 6) > 0xFFFF) {
+        return -EINVAL;
+    }
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    // The divisor and LCR_H must not change while the UART is enabled.
+    // Let the transmitter go idle, disable it and restore CR afterwards.
+    cr = readl(ud->base + PL011_CR);
+    if (cr & PL011_CR_UARTEN) {
+        if (readl_poll_timeout_atomic(ud->base + PL011_FR, fr, !(fr & PL011_FR_BUSY), 1,
+                                      PL011_BUSY_TIMEOUT_US)) {
+            pr_warn("UART%d still busy, changing rate anyway\n", ud->index);
+        }
+        writel(0, ud->base + PL011_CR);
+    }
+    writel(div >> 6, ud->base + PL011_IBRD);
+    writel(div & 0x3F, ud->base + PL011_FBRD);
+    // The divisor is latched by a write to LCR_H
+    writel(readl(ud->base + PL011_LCRH), ud->base + PL011_LCRH);
+    writel(cr, ud->base + PL011_CR);
+    ud->baud = baudrate;
+    spin_unlock_irqrestore(&ud->lock, flags);
+    
+    return 0;
+}
+
+// Loop TX back to RX inside the UART, the pins stay idle. Data still
+// goes through the FIFOs, interrupts and DMA, as with a TX/RX jumper.
+static int pl011_set_loopback(struct uart_dev *ud, bool on)
+{
+    unsigned long flags;
+    u32 cr;
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    cr = readl(ud->base + PL011_CR);
+    if (on) {
+        cr |= PL011_CR_LBE;
+    } else {
+        cr &= ~PL011_CR_LBE;
+    }
+    writel(cr, ud->base + PL011_CR);
+    ud->loopback = on;
+    spin_unlock_irqrestore(&ud->lock, flags);
+    
+    return 0;
+}
+
+// RPI_UART_RX_ERR_* from framing, parity, break and overrun bits in
+// that order, as in PL011_DR >> 8 and PL011_MIS >> 7
+static u32 pl011_rx_err(u32 bits)
+{
+    u32 err = 0;
+
+    if (bits & 1) {
+        err |= RPI_UART_RX_ERR_FRAMING;
+    }
+    if (bits & 2) {
+        err |= RPI_UART_RX_ERR_PARITY;
+    }
+    if (bits & 4) {
+        err |= RPI_UART_RX_ERR_BREAK;
+    }
+    if (bits & 8) {
+        err |= RPI_UART_RX_ERR_OVERRUN;
+    }
+
+    return err;
+}
+
+// PIO receive - empty the RX FIFO into rx_ring
+static void pl011_rx_chars(struct uart_dev *ud)
+{
+    char burst[PL011_FIFO_DEPTH];
+    unsigned int n;
+    u32 err;
+    u32 dr;
+    
+    do {
+        n = 0;
+        err = 0;
+        while (n < sizeof(burst) && !(readl(ud->base + PL011_FR) & PL011_FR_RXFE)) {
+            dr = readl(ud->base + PL011_DR);
+            err |= dr;
+            burst[n++] = (char)(dr & 0xFF);
+        }
+        if (n) {
+            trace_rpi_uart_rx_drain(ud->name, n);
+        }
+        ud->rx_err_flags |= pl011_rx_err(err >> 8);
+        uart_rx_push(ud, burst, n);
+    } while (n == sizeof(burst));
+}
+
+// PIO transmit - refill the TX FIFO from tx_ring, ud->lock held
+static void pl011_tx_chars(struct uart_dev *ud)
+{
+    unsigned int sent = 0;
+    char c;
+    
+    while (!(readl(ud->base + PL011_FR) & PL011_FR_TXFF) &&
+           (uart_ring_get(&ud->tx_ring, &c, 1) || uart_tx_zc_get(ud, &c, 1))) {
+        writel((u32)(c & 0xFF), ud->base + PL011_DR);
+        sent++;
+    }
+    this_cpu_add(ud->stats->tx_bytes, sent);
+    trace_rpi_uart_tx_dequeue(ud->name, sent, uart_ring_count(&ud->tx_ring));
+    
+    if (!uart_tx_pending(ud)) {
+        pl011_set_imsc(ud, 0, PL011_INT_TX);
+    }
+    
+    if (sent) {
+        uart_tx_freed(ud);
+    }
+}
+
+// The PL011s share one interrupt line on BCM2711
+static irqreturn_t pl011_irq_handler(int irq, void *dev_id)
+{
+    struct uart_dev *ud = dev_id;
+    u32 mis = readl(ud->base + PL011_MIS);
+    
+    if (!mis) {
+        return IRQ_NONE;
+    }
+    
+    writel(mis, ud->base + PL011_ICR);
+    trace_rpi_uart_irq(ud->name, mis);
+    this_cpu_inc(ud->stats->irqs);
+    
+    if (mis & (PL011_INT_RX | PL011_INT_RT)) {
+        pl011_rx_chars(ud);
+    }
+    
+    // RX DMA only, PIO takes the flags from PL011_DR. Clearing the
+    // interrupt above also lets DMAONERR resume the RX DMA requests.
+    if (mis & PL011_INT_ERR) {
+        uart_rx_error(ud, pl011_rx_err(mis >> 7));
+    }
+    
+    if (mis & PL011_INT_TX) {
+        spin_lock(&ud->lock);
+        pl011_tx_chars(ud);
+        spin_unlock(&ud->lock);
+    }
+    
+    return IRQ_HANDLED;
+}
+
+static void pl011_dma_tx_done(void *param);
+
+// DMA a zero-copy write straight from its pinned pages, ud->lock held
+static void pl011_dma_tx_zc(struct uart_dev *ud)
+{
+    struct uart_tx_zc *zc = ud->tx_zc;
+    struct dma_async_tx_descriptor *desc;
+
+    // Unmapped, or partly sent by PIO already - the FIFO takes the rest
+    if (!zc->mapped || zc->pos) {
+        pl011_set_imsc(ud, PL011_INT_TX, 0);
+        pl011_tx_chars(ud);
+        return;
+    }
+
+    desc = dmaengine_prep_slave_sg(ud->tx_chan, zc->sgt.sgl, zc->sgt.nents, DMA_MEM_TO_DEV,
+                                   DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!desc) {
+        pl011_set_imsc(ud, PL011_INT_TX, 0);
+        pl011_tx_chars(ud);
+        return;
+    }
+
+    desc->callback = pl011_dma_tx_done;
+    desc->callback_param = ud;
+    ud->tx_dma_len = zc->len;
+    ud->tx_dma_zc = true;
+
+    dmaengine_submit(desc);
+    dma_async_issue_pending(ud->tx_chan);
+}
+
+// Start a DMA transfer of everything queued in tx_ring, ud->lock held.
+// The ring holds at most two contiguous runs, so two sg entries suffice.
+static void pl011_dma_tx_start(struct uart_dev *ud)
+{
+    struct device *dma_dev = ud->tx_chan->device->dev;
+    struct uart_ring *tx_ring = &ud->tx_ring;
+    struct dma_async_tx_descriptor *desc;
+    struct scatterlist sg[2];
+    unsigned int count, offset, first;
+    int nents = 1;
+    
+    // A transfer is in flight, its completion starts the next one
+    if (ud->tx_dma_len) {
+        return;
+    }
+    
+    // Ring bytes first, a zero-copy write only comes after them
+    count = uart_ring_count(tx_ring);
+    if (!count) {
+        if (uart_tx_zc_pending(ud)) {
+            pl011_dma_tx_zc(ud);
+        }
+        return;
+    }
+    
+    offset = tx_ring->tail & (tx_ring->size - 1);
+    first = min(count, tx_ring->size - offset);
+    
+    sg_init_table(sg, 2);
+    sg_dma_address(&sg[0]) = ud->tx_ring_dma + offset;
+    sg_dma_len(&sg[0]) = first;
+    dma_sync_single_for_device(dma_dev, ud->tx_ring_dma + offset, first, DMA_TO_DEVICE);
+    
+    if (count > first) {
+        sg_dma_address(&sg[1]) = ud->tx_ring_dma;
+        sg_dma_len(&sg[1]) = count - first;
+        dma_sync_single_for_device(dma_dev, ud->tx_ring_dma, count - first, DMA_TO_DEVICE);
+        nents = 2;
+    }
+    
+    desc = dmaengine_prep_slave_sg(ud->tx_chan, sg, nents, DMA_MEM_TO_DEV,
+                                   DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+    if (!desc) {
+        // Out of descriptors - send this batch by PIO instead
+        pl011_set_imsc(ud, PL011_INT_TX, 0);
+        pl011_tx_chars(ud);
+        return;
+    }
+    
+    desc->callback = pl011_dma_tx_done;
+    desc->callback_param = ud;
+    ud->tx_dma_len = count;
+    
+    dmaengine_submit(desc);
+    dma_async_issue_pending(ud->tx_chan);
+}
+
+// The DMA engine is done with the bytes, hand the space back to writers
+static void pl011_dma_tx_done(void *param)
+{
+    struct uart_dev *ud = param;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    if (ud->tx_dma_zc) {
+        WRITE_ONCE(ud->tx_zc->pos, ud->tx_zc->len);
+        ud->tx_dma_zc = false;
+    } else {
+        smp_store_release(&ud->tx_ring.tail, ud->tx_ring.tail + ud->tx_dma_len);
+    }
+    this_cpu_add(ud->stats->tx_bytes, ud->tx_dma_len);
+    trace_rpi_uart_tx_dequeue(ud->name, ud->tx_dma_len, uart_ring_count(&ud->tx_ring));
+    ud->tx_dma_len = 0;
+    pl011_dma_tx_start(ud);
+    spin_unlock_irqrestore(&ud->lock, flags);
+    
+    uart_tx_freed(ud);
+}
+
+// A killed zero-copy writer cannot wait for its DMA to finish
+static void pl011_abort_tx_zc(struct uart_dev *ud)
+{
+    unsigned long flags;
+
+    if (!READ_ONCE(ud->tx_dma_zc)) {
+        return;
+    }
+
+    dmaengine_terminate_sync(ud->tx_chan);
+
+    spin_lock_irqsave(&ud->lock, flags);
+    if (ud->tx_dma_zc) {
+        ud->tx_dma_zc = false;
+        ud->tx_dma_len = 0;
+    }
+    spin_unlock_irqrestore(&ud->lock, flags);
+}
+
+static void pl011_start_tx(struct uart_dev *ud)
+{
+    unsigned long flags;
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    if (ud->tx_chan) {
+        pl011_dma_tx_start(ud);
+    } else {
+        // The TX interrupt fires on crossing the FIFO level, prime the FIFO
+        pl011_set_imsc(ud, PL011_INT_TX, 0);
+        pl011_tx_chars(ud);
+    }
+    spin_unlock_irqrestore(&ud->lock, flags);
+}
+
+// Copy what the cyclic RX DMA has written since last time into rx_ring,
+// ud->lock held
+static void pl011_dma_rx_push(struct uart_dev *ud)
+{
+    struct dma_tx_state state;
+    unsigned int pos;
+    
+    if (dmaengine_tx_status(ud->rx_chan, ud->rx_cookie, &state) == DMA_ERROR) {
+        return;
+    }
+    
+    pos = (PL011_RX_DMA_SIZE - state.residue) % PL011_RX_DMA_SIZE;
+    if (pos != ud->rx_dma_pos) {
+        trace_rpi_uart_rx_drain(ud->name, (pos - ud->rx_dma_pos) % PL011_RX_DMA_SIZE);
+    }
+    
+    if (pos < ud->rx_dma_pos) {
+        uart_rx_push(ud, ud->rx_dma_buf + ud->rx_dma_pos, PL011_RX_DMA_SIZE - ud->rx_dma_pos);
+        ud->rx_dma_pos = 0;
+    }
+    uart_rx_push(ud, ud->rx_dma_buf + ud->rx_dma_pos, pos - ud->rx_dma_pos);
+    ud->rx_dma_pos = pos;
+}
+
+// Period completion of the cyclic RX DMA
+static void pl011_dma_rx_period(void *param)
+{
+    struct uart_dev *ud = param;
+    unsigned long flags;
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    pl011_dma_rx_push(ud);
+    spin_unlock_irqrestore(&ud->lock, flags);
+}
+
+// A partly filled period raises no callback, so poll the DMA position
+static enum hrtimer_restart pl011_rx_timer_fn(struct hrtimer *timer)
+{
+    struct uart_dev *ud = container_of(timer, struct uart_dev, rx_timer);
+    unsigned long flags;
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    pl011_dma_rx_push(ud);
+    spin_unlock_irqrestore(&ud->lock, flags);
+    
+    hrtimer_forward_now(timer, us_to_ktime(PL011_RX_POLL_US));
+    return HRTIMER_RESTART;
+}
+
+static int pl011_dma_rx_start(struct uart_dev *ud)
+{
+    struct device *dma_dev = ud->rx_chan->device->dev;
+    struct dma_async_tx_descriptor *desc;
+    
+    ud->rx_dma_buf = dma_alloc_coherent(dma_dev, PL011_RX_DMA_SIZE, &ud->rx_dma, GFP_KERNEL);
+    if (!ud->rx_dma_buf) {
+        return -ENOMEM;
+    }
+    
+    desc = dmaengine_prep_dma_cyclic(ud->rx_chan, ud->rx_dma, PL011_RX_DMA_SIZE,
+                                     PL011_RX_DMA_SIZE / PL011_RX_DMA_PERIODS,
+                                     DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT);
+    if (!desc) {
+        dma_free_coherent(dma_dev, PL011_RX_DMA_SIZE, ud->rx_dma_buf, ud->rx_dma);
+        return -EIO;
+    }
+    
+    desc->callback = pl011_dma_rx_period;
+    desc->callback_param = ud;
+    ud->rx_dma_pos = 0;
+    ud->rx_cookie = dmaengine_submit(desc);
+    dma_async_issue_pending(ud->rx_chan);
+    
+    hrtimer_init(&ud->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ud->rx_timer.function = pl011_rx_timer_fn;
+    hrtimer_start(&ud->rx_timer, us_to_ktime(PL011_RX_POLL_US), HRTIMER_MODE_REL);
+    
+    return 0;
+}
+
+static void pl011_dma_rx_stop(struct uart_dev *ud)
+{
+    hrtimer_cancel(&ud->rx_timer);
+    dmaengine_terminate_sync(ud->rx_chan);
+    dma_free_coherent(ud->rx_chan->device->dev, PL011_RX_DMA_SIZE,
+                      ud->rx_dma_buf, ud->rx_dma);
+}
+
+// Request and configure one DMA channel, NULL if there is none
+static struct dma_chan *pl011_dma_request(struct uart_dev *ud, const char *name,
+                                          enum dma_transfer_direction dir)
+{
+    struct dma_slave_config cfg = {
+        .direction = dir,
+        .src_addr = ud->phys + PL011_DR,
+        .dst_addr = ud->phys + PL011_DR,
+        .src_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE,
+        .dst_addr_width = DMA_SLAVE_BUSWIDTH_1_BYTE,
+        .src_maxburst = PL011_FIFO_DEPTH / 2,
+        .dst_maxburst = PL011_FIFO_DEPTH / 2,
+    };
+    struct dma_chan *chan;
+    
+    if (!ud->np) {
+        return NULL;
+    }
+    
+    chan = of_dma_request_slave_channel(ud->np, name);
+    if (IS_ERR(chan)) {
+        pr_info("%s: no %s DMA channel, using PIO\n", ud->name, name);
+        return NULL;
+    }
+    
+    if (dmaengine_slave_config(chan, &cfg)) {
+        dma_release_channel(chan);
+        return NULL;
+    }
+    
+    return chan;
+}
+
+static int pl011_startup(struct uart_dev *ud)
+{
+    u32 dmacr = 0;
+    int ret;
+    
+    ret = request_irq(ud->irq, pl011_irq_handler, IRQF_SHARED, "rpi_uart", ud);
+    if (ret) {
+        pr_err("Failed to request IRQ %d\n", ud->irq);
+        return ret;
+    }
+    
+    ud->tx_chan = pl011_dma_request(ud, "tx", DMA_MEM_TO_DEV);
+    if (ud->tx_chan) {
+        ud->tx_ring_dma = dma_map_single(ud->tx_chan->device->dev, ud->tx_ring.buf,
+                                         ud->tx_ring.size, DMA_TO_DEVICE);
+        if (dma_mapping_error(ud->tx_chan->device->dev, ud->tx_ring_dma)) {
+            dma_release_channel(ud->tx_chan);
+            ud->tx_chan = NULL;
+        } else {
+            dmacr |= PL011_DMACR_TXDMAE;
+        }
+    }
+    
+    ud->rx_chan = pl011_dma_request(ud, "rx", DMA_DEV_TO_MEM);
+    if (ud->rx_chan && pl011_dma_rx_start(ud)) {
+        dma_release_channel(ud->rx_chan);
+        ud->rx_chan = NULL;
+    }
+    if (ud->rx_chan) {
+        dmacr |= PL011_DMACR_RXDMAE | PL011_DMACR_DMAONERR;
+    }
+    
+    writel(dmacr, ud->base + PL011_DMACR);
+    
+    // PIO receive when there is no RX DMA, TX interrupt is enabled on
+    // demand. Line errors only need an interrupt of their own with DMA.
+    spin_lock_irq(&ud->lock);
+    pl011_set_imsc(ud, ud->rx_chan ? PL011_INT_ERR : PL011_INT_RX | PL011_INT_RT, ~0);
+    spin_unlock_irq(&ud->lock);
+    
+    pr_info("%s: TX %s, RX %s\n", ud->name, ud->tx_chan ? "DMA" : "PIO",
+            ud->rx_chan ? "DMA" : "PIO");
+    return 0;
+}
+
+static void pl011_shutdown(struct uart_dev *ud)
+{
+    spin_lock_irq(&ud->lock);
+    pl011_set_imsc(ud, 0, ~0);
+    spin_unlock_irq(&ud->lock);
+    
+    writel(0, ud->base + PL011_DMACR);
+    
+    if (ud->rx_chan) {
+        pl011_dma_rx_stop(ud);
+        dma_release_channel(ud->rx_chan);
+        ud->rx_chan = NULL;
+    }
+    
+    if (ud->tx_chan) {
+        dmaengine_terminate_sync(ud->tx_chan);
+        dma_unmap_single(ud->tx_chan->device->dev, ud->tx_ring_dma,
+                         ud->tx_ring.size, DMA_TO_DEVICE);
+        dma_release_channel(ud->tx_chan);
+        ud->tx_chan = NULL;
+        ud->tx_dma_len = 0;
+    }
+    
+    free_irq(ud->irq, ud);
+}
+
+// Apply the default pinctrl state of the port's device tree node, as the
+// driver core does for the Mini UART, so the pins go through the pinctrl
+// driver's locking. The node has a platform or an AMBA device.
+static int pl011_select_pins(struct uart_dev *ud)
+{
+    struct platform_device *pdev = of_find_device_by_node(ud->np);
+    struct device *dev;
+    struct pinctrl *p;
+
+    dev = pdev ? &pdev->dev : bus_find_device_by_of_node(&amba_bustype, ud->np);
+    if (!dev) {
+        pr_err("UART%d: no device for %pOF to apply its pinctrl state\n", ud->index, ud->np);
+        return -ENODEV;
+    }
+
+    p = pinctrl_get_select_default(dev);
+    if (IS_ERR(p)) {
+        pr_err("UART%d: cannot select pinctrl state: %ld\n", ud->index, PTR_ERR(p));
+        put_device(dev);
+        return PTR_ERR(p);
+    }
+
+    ud->pin_dev = dev;
+    ud->pinctrl = p;
+    return 0;
+}
+
+static void pl011_release_pins(struct uart_dev *ud)
+{
+    if (ud->pin_dev) {
+        pinctrl_put(ud->pinctrl);
+        put_device(ud->pin_dev);
+        ud->pin_dev = NULL;
+    }
+}
+
+static int pl011_probe(struct uart_dev *ud)
+{
+    int ret;
+    u32 fr;
+    
+    if (ud->index != 0 && (ud->index < 2 || ud->index > 5)) {
+        pr_err("PL011: no UART%d, use 0 or 2-5\n", ud->index);
+        return -EINVAL;
+    }
+    
+    ud->phys = PL011_BASE(ud->index);
+    ud->base = ioremap(ud->phys, PL011_REG_SIZE);
+    if (!ud->base) {
+        pr_err("Failed to map PL011 registers\n");
+        return -ENOMEM;
+    }
+    
+    ud->np = pl011_find_node(ud->phys);
+    
+    ud->irq = ud->np ? irq_of_parse_and_map(ud->np, 0) : 0;
+    if (!ud->irq) {
+        pr_err("Failed to find the UART%d interrupt\n", ud->index);
+        ret = -ENODEV;
+        goto err_unmap;
+    }
+    
+    ud->clock_rate = PL011_CLOCK;
+    uart_get_clock(ud, of_clk_get_by_name(ud->np, "uartclk"));
+    
+    // UART0 is on GPIO14/15 ALT0, UART2-5 on GPIO0/1, 4/5, 8/9, 12/13 ALT4
+    if (ud->np && of_property_present(ud->np, "pinctrl-0")) {
+        ret = pl011_select_pins(ud);
+        if (ret) {
+            goto err_put_clock;
+        }
+    } else if (ud->index == 0) {
+        uart_gpio_setup_pair(14, GPIO_FSEL_ALT0);
+    } else {
+        uart_gpio_setup_pair((ud->index - 2) * 4, GPIO_FSEL_ALT4);
+    }
+    
+    // Disable, wait for the last character, then flush the FIFOs
+    writel(0, ud->base + PL011_CR);
+    if (readl_poll_timeout_atomic(ud->base + PL011_FR, fr, !(fr & PL011_FR_BUSY), 1,
+                                  PL011_BUSY_TIMEOUT_US)) {
+        pr_warn("UART%d still busy, flushing anyway\n", ud->index);
+    }
+    writel(0, ud->base + PL011_LCRH);
+    writel(0, ud->base + PL011_IMSC);
+    writel(0x7FF, ud->base + PL011_ICR);
+    
+    ret = pl011_set_baud(ud, ud->baud);
+    if (ret) {
+        pr_err("Unsupported baud rate %u\n", ud->baud);
+        goto err_release_pins;
+    }
+    
+    writel(PL011_LCRH_WLEN_8 | PL011_LCRH_FEN, ud->base + PL011_LCRH);
+    writel(PL011_IFLS_RX_HALF | PL011_IFLS_TX_HALF, ud->base + PL011_IFLS);
+    writel(PL011_CR_UARTEN | PL011_CR_TXE | PL011_CR_RXE, ud->base + PL011_CR);
+    
+    pr_info("PL011 UART%d initialized at %u baud\n", ud->index, ud->baud);
+    return 0;
+
+err_release_pins:
+    pl011_release_pins(ud);
+err_put_clock:
+    uart_put_clock(ud);
+err_unmap:
+    of_node_put(ud->np);
+    ud->np = NULL;
+    iounmap(ud->base);
+    return ret;
+}
+
+static void pl011_remove(struct uart_dev *ud)
+{
+    writel(0, ud->base + PL011_CR);
+    
+    pl011_release_pins(ud);
+    uart_put_clock(ud);
+    of_node_put(ud->np);
+    ud->np = NULL;
+    iounmap(ud->base);
+}
+
+static const struct uart_backend pl011_backend = {
+    .name = "PL011",
+    .dev_name = UART_PL011_DEV_NAME,
+    .probe = pl011_probe,
+    .remove = pl011_remove,
+    .startup = pl011_startup,
+    .shutdown = pl011_shutdown,
+    .start_tx = pl011_start_tx,
+    .set_baud = pl011_set_baud,
+    .set_loopback = pl011_set_loopback,
+    .abort_tx_zc = pl011_abort_tx_zc,
+};
+
+// Remove NUL bytes from buf in place, returns the new length
+static size_t uart_drop_nul(char *buf, size_t len)
+{
+    size_t i, n = 0;
+    
+    for (i = 0; i < len; i++) {
+        if (buf[i] != 0) {
+            buf[n++] = buf[i];
+        }
+    }
+    
+    return n;
+}
+
+// Sleep until the RX ring has data, for at most us microseconds (0 = no
+// limit). Returns 0 when data arrived, -ETIME on timeout, -ENODEV once
+// the port is unbound or -ERESTARTSYS.
+static int uart_rx_wait(struct uart_dev *ud, u32 us)
+{
+    ktime_t end = ktime_add_us(ktime_get(), us);
+    int ret;
+    
+    for (;;) {
+        if (!us) {
+            ret = wait_event_interruptible(ud->rx_wait, uart_ring_count(&ud->rx_ring) ||
+                                           READ_ONCE(ud->gone));
+        } else {
+            ret = wait_event_interruptible_hrtimeout(ud->rx_wait, uart_ring_count(&ud->rx_ring) ||
+                                                     READ_ONCE(ud->gone),
+                                                     ktime_sub(end, ktime_get()));
+        }
+        if (ret || uart_ring_count(&ud->rx_ring)) {
+            break;
+        }
+        
+        // Woken by unbind, or another reader took the data first
+        if (READ_ONCE(ud->gone)) {
+            return -ENODEV;
+        }
+    }
+    
+    if (!ret) {
+        trace_rpi_uart_rx_wake(ud->name, uart_ring_count(&ud->rx_ring));
+    }
+    
+    return ret;
+}
+
+// I/O that must not sleep: O_NONBLOCK files and IOCB_NOWAIT requests,
+// e.g. io_uring trying the fast path before punting to a worker
+static bool uart_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// Decode a COBS frame in place, delimiter already stripped. A non-zero
+// delimiter is handled as COBS over bytes XORed with it. Returns the
+// decoded length, or -EBADMSG for an invalid encoding.
+static int uart_cobs_decode(char *buf, unsigned int len, u8 delim)
+{
+    unsigned int in = 0, out = 0;
+    unsigned int i;
+    u8 code;
+
+    if (delim) {
+        for (i = 0; i < len; i++) {
+            buf[i] ^= delim;
+        }
+    }
+
+    while (in < len) {
+        code = buf[in++];
+        if (!code || code - 1 > len - in) {
+            return -EBADMSG;
+        }
+
+        for (i = 1; i < code; i++) {
+            buf[out++] = buf[in++];
+        }
+
+        // A maximal block and the last block carry no implicit zero
+        if (code != 0xFF && in < len) {
+            buf[out++] = 0;
+        }
+    }
+
+    return out;
+}
+
+// Packet mode read - one frame per call, delimiter stripped and COBS
+// decoded. Like a datagram, a frame longer than count is truncated.
+// Invalid frames are dropped and counted in rx_bad_frames.
+static ssize_t uart_read_frame(struct kiocb *iocb, struct iov_iter *to,
+                               struct uart_dev *ud, u32 framing)
+{
+    struct uart_file *uf = iocb->ki_filp->private_data;
+    u8 delim = UART_FRAMING_DELIM(framing);
+    unsigned int len, start, pos;
+    char *kbuf;
+    ssize_t ret;
+    int n;
+
+    kbuf = kmalloc(ud->rx_ring.size, GFP_KERNEL);
+    if (!kbuf) {
+        return -ENOMEM;
+    }
+
+    for (;;) {
+        len = uart_frame_take(ud, kbuf, &pos);
+        if (!len) {
+            if (uart_nowait(iocb)) {
+                ret = -EAGAIN;
+                break;
+            }
+
+            if (!uf->timing.first_us) {
+                ret = wait_event_interruptible(ud->rx_wait, uart_frame_ready(ud) ||
+                                               READ_ONCE(ud->gone));
+            } else {
+                ret = wait_event_interruptible_hrtimeout(ud->rx_wait, uart_frame_ready(ud) ||
+                                                         READ_ONCE(ud->gone),
+                                                         us_to_ktime(uf->timing.first_us));
+            }
+            // Woken by unbind, or another reader took the frame first
+            if (!ret && READ_ONCE(ud->gone) && !uart_frame_ready(ud)) {
+                ret = -ENODEV;
+            }
+            if (ret == -ETIME) {
+                ret = 0;  // Timeout returns 0, as in stream mode
+                break;
+            }
+            if (ret) {
+                break;
+            }
+            trace_rpi_uart_rx_wake(ud->name, uart_ring_count(&ud->rx_ring));
+            continue;
+        }
+
+        trace_rpi_uart_rx_dequeue(ud->name, len, uart_ring_count(&ud->rx_ring));
+
+        // Skip delimiters of empty frames, then drop the frame's own one.
+        // A frame cut at ring size has none and is dropped.
+        for (start = 0; start < len && (u8)kbuf[start] == delim; start++)
+            ;
+        if (start == len || (u8)kbuf[len - 1] != delim) {
+            this_cpu_inc(ud->stats->rx_bad_frames);
+            continue;
+        }
+        len--;
+
+        n = len - start;
+        if (UART_FRAMING_MODE(framing) == RPI_UART_FRAME_COBS) {
+            n = uart_cobs_decode(kbuf + start, n, delim);
+            if (n < 0) {
+                this_cpu_inc(ud->stats->rx_bad_frames);
+                continue;
+            }
+        }
+
+        n = min_t(size_t, n, iov_iter_count(to));
+        if (copy_to_iter(kbuf + start, n, to) != n) {
+            ret = -EFAULT;
+            break;
+        }
+        trace_rpi_uart_copy_to_user(ud->name, n);
+        uart_rx_stamp_find(ud, pos + start, &uf->rx_stamp);
+        ret = n;
+        break;
+    }
+
+    kfree(kbuf);
+    return ret;
+}
+
+// Character device read - blocks until data arrives (unless nonblocking),
+// then keeps reading as set by the file's read timing (see
+// RPI_UART_IOC_SET_READ_TIMING). By default reads never signal EOF,
+// the device is a continuous stream. Also serves readv() and io_uring.
+static ssize_t uart_read_port(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct uart_file *uf = iocb->ki_filp->private_data;
+    struct uart_dev *ud = uf->ud;
+    bool nowait = uart_nowait(iocb);
+    size_t count = iov_iter_count(to);
+    char *kbuf;
+    size_t done = 0;
+    size_t n;
+    ssize_t ret = 0;
+    unsigned int pos;
+    u32 framing = READ_ONCE(ud->framing);
+    
+    if (UART_FRAMING_MODE(framing) != RPI_UART_FRAME_NONE) {
+        return uart_read_frame(iocb, to, ud, framing);
+    }
+    
+    kbuf = kmalloc(UART_CHUNK_SIZE, GFP_KERNEL);
+    if (!kbuf) {
+        return -ENOMEM;
+    }
+    
+    while (done < count) {
+        spin_lock(&ud->rx_lock);
+        pos = READ_ONCE(*uart_ring_tail(&ud->rx_ring));
+        n = uart_ring_get(&ud->rx_ring, kbuf, min_t(size_t, count - done, UART_CHUNK_SIZE));
+        spin_unlock(&ud->rx_lock);
+        if (n) {
+            trace_rpi_uart_rx_dequeue(ud->name, n, uart_ring_count(&ud->rx_ring));
+            if (!done) {
+                uart_rx_stamp_find(ud, pos, &uf->rx_stamp);
+            }
+        }
+        
+        // NUL bytes are dropped in text mode, as with the old polled receive path
+        if (!uf->raw) {
+            n = uart_drop_nul(kbuf, n);
+        }
+        
+        if (n) {
+            if (copy_to_iter(kbuf, n, to) != n) {
+                ret = -EFAULT;
+                break;
+            }
+            trace_rpi_uart_copy_to_user(ud->name, n);
+            done += n;
+            
+            if (uart_ring_count(&ud->rx_ring)) {
+                continue;
+            }
+        }
+        
+        if (done >= count) {
+            break;
+        }
+        
+        if (done == 0) {
+            // Nothing yet - sleep until the IRQ handler queues data
+            if (nowait) {
+                ret = -EAGAIN;
+                break;
+            }
+            ret = uart_rx_wait(ud, uf->timing.first_us);
+            if (ret == -ETIME) {
+                ret = 0;  // First-byte timeout returns 0, like VTIME with VMIN 0
+                break;
+            }
+            if (ret) {
+                break;
+            }
+            continue;
+        }
+        
+        if (nowait || !uf->timing.idle_us ||
+            (uf->timing.vmin && done >= uf->timing.vmin)) {
+            break;
+        }
+        
+        if (uart_rx_wait(ud, uf->timing.idle_us)) {
+            break; // Line idle or signal - return what we have
+        }
+    }
+    
+    kfree(kbuf);
+    
+    if (done) {
+        pr_debug("%s RX: received %zu bytes\n", ud->name, done);
+        return done;
+    }
+    
+    return ret;
+}
+
+// Room for need bytes in the TX ring, and no zero-copy write holding it
+static bool uart_tx_room(struct uart_dev *ud, unsigned int need)
+{
+    return !READ_ONCE(ud->tx_zc) && uart_ring_space(&ud->tx_ring) >= need;
+}
+
+// Wait until the TX ring has room for need bytes
+static int uart_tx_wait_space(struct uart_dev *ud, bool nowait, unsigned int need)
+{
+    ktime_t start;
+    int ret;
+
+    while (!uart_tx_room(ud, need)) {
+        // Make sure the backend is draining the ring before sleeping
+        ud->backend->start_tx(ud);
+
+        if (nowait) {
+            return -EAGAIN;
+        }
+
+        start = ktime_get();
+        ret = wait_event_interruptible(ud->tx_wait, uart_tx_room(ud, need) ||
+                                       READ_ONCE(ud->gone));
+        this_cpu_add(ud->stats->tx_wait_us, ktime_us_delta(ktime_get(), start));
+        if (ret) {
+            return -ERESTARTSYS;
+        }
+        if (READ_ONCE(ud->gone)) {
+            return -ENODEV;
+        }
+    }
+
+    return 0;
+}
+
+// Queue bytes, in text mode with a carriage return before each newline.
+// With whole set, the bytes and their translation (whole bytes in all)
+// go in at once when that much is free, so they cannot interleave with
+// other writers. Otherwise each turn on tx_lock queues what fits.
+// Returns the number consumed, or an error if nothing could be.
+static ssize_t uart_queue(struct uart_dev *ud, bool nowait, bool raw,
+                          const char *kbuf, size_t len, unsigned int whole)
+{
+    size_t i = 0;
+    unsigned int need;
+    int ret;
+    
+    while (i < len) {
+        // Carriage return before newline, queued as one unit
+        need = whole ?: (!raw && kbuf[i] == '\n' ? 2 : 1);
+        ret = uart_tx_wait_space(ud, nowait, need);
+        if (ret) {
+            return i ? i : ret;
+        }
+        
+        spin_lock_bh(&ud->tx_lock);
+        // Another writer may have taken the space, then wait again
+        if (uart_tx_room(ud, need)) {
+            if (raw) {
+                i += uart_ring_put_many(&ud->tx_ring, kbuf + i, len - i);
+            } else {
+                for (; i < len; i++) {
+                    if (kbuf[i] == '\n') {
+                        if (uart_ring_space(&ud->tx_ring) < 2) {
+                            break;
+                        }
+                        uart_ring_put(&ud->tx_ring, '\r');
+                    }
+                    if (!uart_ring_put(&ud->tx_ring, kbuf[i])) {
+                        break;
+                    }
+                }
+            }
+        }
+        spin_unlock_bh(&ud->tx_lock);
+        ud->backend->start_tx(ud);
+    }
+    
+    return i;
+}
+
+// Bytes a write of len bytes takes in the TX ring, if it is to be
+// queued whole, else 0
+static unsigned int uart_write_whole(struct uart_dev *ud, bool raw,
+                                     const char *kbuf, size_t len)
+{
+    unsigned int limit = min3(READ_ONCE(atomic_write), ud->tx_ring.size / 2,
+                              (unsigned int)UART_CHUNK_SIZE);
+    unsigned int need = len;
+    size_t i;
+    
+    if (len > limit) {
+        return 0;
+    }
+    
+    if (!raw) {
+        for (i = 0; i < len; i++) {
+            need += kbuf[i] == '\n';
+        }
+    }
+    
+    return need;
+}
+
+// Send one pinned piece of a zero-copy write and wait until the TX path
+// has taken all of it. Only a fatal signal ends the wait early, DMA may
+// be reading the pages. Returns 0 or -EINTR, the bytes taken in *sent.
+static int uart_tx_zc_send(struct uart_dev *ud, struct uart_tx_zc *zc,
+                           size_t offset, size_t len, size_t *sent)
+{
+    struct device *dma_dev = NULL;
+    unsigned long flags;
+    int ret = 0;
+
+    // Map for the TX DMA channel if there is one, PIO sends it otherwise
+    if (ud->tx_chan &&
+        !sg_alloc_table_from_pages(&zc->sgt, zc->pages, DIV_ROUND_UP(offset + len, PAGE_SIZE),
+                                   offset, len, GFP_KERNEL)) {
+        dma_dev = ud->tx_chan->device->dev;
+        if (dma_map_sgtable(dma_dev, &zc->sgt, DMA_TO_DEVICE, 0)) {
+            sg_free_table(&zc->sgt);
+            dma_dev = NULL;
+        }
+    }
+
+    spin_lock_irqsave(&ud->lock, flags);
+    zc->offset = offset;
+    zc->len = len;
+    zc->pos = 0;
+    zc->mapped = dma_dev != NULL;
+    spin_unlock_irqrestore(&ud->lock, flags);
+
+    ud->backend->start_tx(ud);
+
+    ret = wait_event_killable(ud->tx_wait, READ_ONCE(zc->pos) == len || READ_ONCE(ud->gone));
+    if (READ_ONCE(zc->pos) != len) {
+        // Killed or unbound: nothing more is taken from the pages
+        spin_lock_irqsave(&ud->lock, flags);
+        zc->len = zc->pos;
+        spin_unlock_irqrestore(&ud->lock, flags);
+
+        if (ud->backend->abort_tx_zc) {
+            ud->backend->abort_tx_zc(ud);
+        }
+        ret = ret ? -EINTR : -ENODEV;
+    }
+    *sent = zc->pos;
+
+    if (dma_dev) {
+        dma_unmap_sgtable(dma_dev, &zc->sgt, DMA_TO_DEVICE, 0);
+        sg_free_table(&zc->sgt);
+    }
+
+    return ret;
+}
+
+// Zero-copy write (tx_zerocopy): each piece of the user buffers is pinned
+// and sent in place - the PL011 DMA reads the pages, FIFO refills copy
+// straight from them - with no staging buffer or TX ring copy. The
+// write holds the TX path from start to end, so a header and payload
+// given to writev() go out back to back.
+static ssize_t uart_write_zc(struct uart_dev *ud, struct iov_iter *from)
+{
+    struct uart_tx_zc zc = { };
+    struct page **pages = zc.pages;
+    unsigned long flags;
+    size_t done = 0;
+    size_t offset, sent;
+    bool claimed;
+    ssize_t n;
+    int ret = 0;
+
+    // Claim the TX path behind bytes already queued by other writers
+    do {
+        if (wait_event_interruptible(ud->tx_wait, !READ_ONCE(ud->tx_zc) || READ_ONCE(ud->gone))) {
+            return -ERESTARTSYS;
+        }
+        if (READ_ONCE(ud->gone)) {
+            return -ENODEV;
+        }
+
+        spin_lock_bh(&ud->tx_lock);
+        claimed = !ud->tx_zc;
+        if (claimed) {
+            spin_lock_irqsave(&ud->lock, flags);
+            ud->tx_zc = &zc;
+            spin_unlock_irqrestore(&ud->lock, flags);
+        }
+        spin_unlock_bh(&ud->tx_lock);
+    } while (!claimed);
+
+    while (iov_iter_count(from)) {
+        n = iov_iter_extract_pages(from, &pages, UART_ZC_PAGES * PAGE_SIZE,
+                                   UART_ZC_PAGES, 0, &offset);
+        if (n <= 0) {
+            ret = n ?: -EFAULT;
+            break;
+        }
+
+        ret = uart_tx_zc_send(ud, &zc, offset, n, &sent);
+        if (iov_iter_extract_will_pin(from)) {
+            unpin_user_pages(zc.pages, DIV_ROUND_UP(offset + n, PAGE_SIZE));
+        }
+        done += sent;
+        if (ret) {
+            break;
+        }
+    }
+
+    spin_lock_bh(&ud->tx_lock);
+    spin_lock_irqsave(&ud->lock, flags);
+    ud->tx_zc = NULL;
+    spin_unlock_irqrestore(&ud->lock, flags);
+    spin_unlock_bh(&ud->tx_lock);
+
+    // Let other writers go on
+    wake_up(&ud->tx_wait);
+    ud->backend->start_tx(ud);
+
+    if (done) {
+        pr_debug("%s TX: sent %zu bytes zero-copy\n", ud->name, done);
+        return done;
+    }
+
+    return ret;
+}
+
+// Character device write - queues the bytes for the TX interrupt and
+// only blocks while the TX ring is full. Writes up to atomic_write bytes
+// go out whole, like pipe writes up to PIPE_BUF; larger ones are streamed
+// through the ring a chunk at a time. Also serves writev() and io_uring.
+static ssize_t uart_write_port(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct uart_file *uf = iocb->ki_filp->private_data;
+    struct uart_dev *ud = uf->ud;
+    bool nowait = uart_nowait(iocb);
+    size_t count = iov_iter_count(from);
+    char *kbuf;
+    size_t done = 0;
+    size_t len;
+    ssize_t ret = 0;
+    unsigned int zc_min = READ_ONCE(tx_zerocopy);
+    
+    if (zc_min && count >= zc_min && uf->raw && !nowait && user_backed_iter(from)) {
+        return uart_write_zc(ud, from);
+    }
+    
+    kbuf = kmalloc(UART_CHUNK_SIZE, GFP_KERNEL);
+    if (!kbuf) {
+        return -ENOMEM;
+    }
+    
+    while (done < count) {
+        len = min_t(size_t, count - done, UART_CHUNK_SIZE);
+        
+        if (copy_from_iter(kbuf, len, from) != len) {
+            ret = -EFAULT;
+            break;
+        }
+        trace_rpi_uart_copy_from_user(ud->name, len);
+        
+        ret = uart_queue(ud, nowait, uf->raw, kbuf, len,
+                         count == len ? uart_write_whole(ud, uf->raw, kbuf, len) : 0);
+        
+        if (ret < 0) {
+            break;
+        }
+        
+        trace_rpi_uart_tx_enqueue(ud->name, ret, ud->tx_ring.size - uart_ring_space(&ud->tx_ring));
+        done += ret;
+        
+        if ((size_t)ret < len) {
+            break;  // Ring full without waiting, or a signal
+        }
+    }
+    
+    uart_stat_max(ud, tx_high, ud->tx_ring.size - uart_ring_space(&ud->tx_ring));
+    ud->backend->start_tx(ud);
+    kfree(kbuf);
+    
+    if (done) {
+        pr_debug("%s TX: queued %zu bytes\n", ud->name, done);
+        return done;
+    }
+    
+    return ret;
+}
+
+// poll/epoll - readable when the RX ring has data, writable when the
+// TX ring has room for at least a CR/LF pair
+static __poll_t uart_poll(struct file *file, poll_table *wait)
+{
+    struct uart_file *uf = file->private_data;
+    struct uart_dev *ud = uf->ud;
+    __poll_t mask = 0;
+    
+    poll_wait(file, &ud->rx_wait, wait);
+    poll_wait(file, &ud->tx_wait, wait);
+    
+    if (READ_ONCE(ud->gone)) {
+        return EPOLLHUP | EPOLLERR;
+    }
+    
+    // In packet mode only a complete frame makes the device readable
+    if (UART_FRAMING_MODE(READ_ONCE(ud->framing)) != RPI_UART_FRAME_NONE ?
+        uart_frame_ready(ud) : uart_ring_count(&ud->rx_ring)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (uart_tx_room(ud, 2)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    if (READ_ONCE(ud->rx_err.events) != uf->rx_err_seen) {
+        mask |= EPOLLPRI;
+    }
+    
+    return mask;
+}
+
+static long uart_ioctl_port(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct uart_file *uf = file->private_data;
+    struct uart_dev *ud = uf->ud;
+    u32 __user *argp = (u32 __user *)arg;
+    struct rpi_uart_framing framing;
+    struct rpi_uart_rx_errors err;
+    unsigned long flags;
+    u32 val;
+    
+    switch (cmd) {
+    case RPI_UART_IOC_SET_RAW:
+        if (get_user(val, argp)) {
+            return -EFAULT;
+        }
+        uf->raw = !!val;
+        return 0;
+    case RPI_UART_IOC_GET_RAW:
+        return put_user(uf->raw ? 1 : 0, argp);
+    case RPI_UART_IOC_SET_READ_TIMING:
+        if (copy_from_user(&uf->timing, (void __user *)arg, sizeof(uf->timing))) {
+            return -EFAULT;
+        }
+        return 0;
+    case RPI_UART_IOC_GET_READ_TIMING:
+        if (copy_to_user((void __user *)arg, &uf->timing, sizeof(uf->timing))) {
+            return -EFAULT;
+        }
+        return 0;
+    case RPI_UART_IOC_SET_BAUD:
+        if (get_user(val, argp)) {
+            return -EFAULT;
+        }
+        return ud->backend->set_baud(ud, val);
+    case RPI_UART_IOC_GET_BAUD:
+        return put_user(READ_ONCE(ud->baud), argp);
+    case RPI_UART_IOC_SET_FRAMING:
+        if (copy_from_user(&framing, (void __user *)arg, sizeof(framing))) {
+            return -EFAULT;
+        }
+        if (framing.mode > RPI_UART_FRAME_COBS || framing.delim > 0xFF) {
+            return -EINVAL;
+        }
+        WRITE_ONCE(ud->framing, UART_FRAMING(framing.mode, framing.delim));
+        return 0;
+    case RPI_UART_IOC_GET_FRAMING:
+        val = READ_ONCE(ud->framing);
+        framing.mode = UART_FRAMING_MODE(val);
+        framing.delim = UART_FRAMING_DELIM(val);
+        if (copy_to_user((void __user *)arg, &framing, sizeof(framing))) {
+            return -EFAULT;
+        }
+        return 0;
+    case RPI_UART_IOC_SET_LOOPBACK:
+        // The Mini UART has no loopback, jumper TX to RX instead
+        if (!ud->backend->set_loopback) {
+            return -EOPNOTSUPP;
+        }
+        if (get_user(val, argp)) {
+            return -EFAULT;
+        }
+        return ud->backend->set_loopback(ud, !!val);
+    case RPI_UART_IOC_GET_LOOPBACK:
+        return put_user(READ_ONCE(ud->loopback) ? 1 : 0, argp);
+    case RPI_UART_IOC_GET_RX_STAMP:
+        if (copy_to_user((void __user *)arg, &uf->rx_stamp, sizeof(uf->rx_stamp))) {
+            return -EFAULT;
+        }
+        return 0;
+    case RPI_UART_IOC_GET_RX_ERRORS:
+        spin_lock_irqsave(&ud->rx_err_lock, flags);
+        err = ud->rx_err;
+        spin_unlock_irqrestore(&ud->rx_err_lock, flags);
+        
+        if (copy_to_user((void __user *)arg, &err, sizeof(err))) {
+            return -EFAULT;
+        }
+        uf->rx_err_seen = err.events;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+// Last reference dropped: the port is stopped, no file or mapping is left
+static void uart_dev_free(struct kref *ref)
+{
+    struct uart_dev *ud = container_of(ref, struct uart_dev, ref);
+
+    kfree(ud->tx_ring.buf);
+    vfree(ud->rx_ring.shared);
+    free_percpu(ud->stats);
+    kfree(ud);
+}
+
+static void uart_put(struct uart_dev *ud)
+{
+    kref_put(&ud->ref, uart_dev_free);
+}
+
+// A file operation may use the hardware until uart_io_end() unless this
+// fails: -ENODEV once the port is unbound, or -EAGAIN if nowait and
+// unbind holds io_sem, so the non-blocking fast path never sleeps here
+static int uart_io_begin(struct uart_dev *ud, bool nowait)
+{
+    if (!nowait) {
+        down_read(&ud->io_sem);
+    } else if (!down_read_trylock(&ud->io_sem)) {
+        return -EAGAIN;
+    }
+
+    if (READ_ONCE(ud->gone)) {
+        up_read(&ud->io_sem);
+        return -ENODEV;
+    }
+
+    return 0;
+}
+
+static void uart_io_end(struct uart_dev *ud)
+{
+    up_read(&ud->io_sem);
+}
+
+static ssize_t uart_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct uart_file *uf = iocb->ki_filp->private_data;
+    ssize_t ret;
+
+    ret = uart_io_begin(uf->ud, uart_nowait(iocb));
+    if (ret) {
+        return ret;
+    }
+    ret = uart_read_port(iocb, to);
+    uart_io_end(uf->ud);
+    return ret;
+}
+
+static ssize_t uart_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct uart_file *uf = iocb->ki_filp->private_data;
+    ssize_t ret;
+
+    ret = uart_io_begin(uf->ud, uart_nowait(iocb));
+    if (ret) {
+        return ret;
+    }
+    ret = uart_write_port(iocb, from);
+    uart_io_end(uf->ud);
+    return ret;
+}
+
+static long uart_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct uart_file *uf = file->private_data;
+    long ret;
+
+    ret = uart_io_begin(uf->ud, false);
+    if (ret) {
+        return ret;
+    }
+    ret = uart_ioctl_port(file, cmd, arg);
+    uart_io_end(uf->ud);
+    return ret;
+}
+
+// Mappings of the RX ring, duplicated by fork() or split
+static void uart_vm_open(struct vm_area_struct *vma)
+{
+    struct uart_dev *ud = vma->vm_private_data;
+
+    kref_get(&ud->ref);
+}
+
+static void uart_vm_close(struct vm_area_struct *vma)
+{
+    uart_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct uart_vm_ops = {
+    .open = uart_vm_open,
+    .close = uart_vm_close,
+};
+
+// Without a wake-up interrupt nothing notices RX while the clock is gated,
+// so every open file and kernel client keeps the port powered. With one,
+// the port suspends whenever it has been idle for the autosuspend delay.
+static int uart_pm_hold(struct uart_dev *ud)
+{
+    if (!ud->pm || ud->wake_irq) {
+        return 0;
+    }
+
+    return pm_runtime_resume_and_get(ud->dev);
+}
+
+static void uart_pm_release(struct uart_dev *ud)
+{
+    if (!ud->pm || ud->wake_irq) {
+        return;
+    }
+
+    pm_runtime_mark_last_busy(ud->dev);
+    pm_runtime_put_autosuspend(ud->dev);
+}
+
+// Any number of files may share a port. Opening with O_EXCL claims it:
+// that open fails with -EBUSY if the port is already open, and every
+// other open fails while the exclusive file stays open.
+static int uart_open(struct inode *inode, struct file *file)
+{
+    // misc_open() leaves the miscdevice in private_data
+    struct uart_dev *ud = container_of(file->private_data, struct uart_dev, miscdev);
+    bool excl = file->f_flags & O_EXCL;
+    struct uart_file *uf;
+    unsigned long flags;
+    int ret;
+    
+    uf = kzalloc(sizeof(*uf), GFP_KERNEL);
+    if (!uf) {
+        return -ENOMEM;
+    }
+    
+    ret = uart_pm_hold(ud);
+    if (ret) {
+        kfree(uf);
+        return ret;
+    }
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    if (ud->open_excl || (excl && ud->open_count)) {
+        spin_unlock_irqrestore(&ud->lock, flags);
+        uart_pm_release(ud);
+        kfree(uf);
+        return -EBUSY;
+    }
+    ud->open_count++;
+    ud->open_excl = excl;
+    spin_unlock_irqrestore(&ud->lock, flags);
+    
+    // misc_deregister() has not returned yet, ud is still live
+    kref_get(&ud->ref);
+    uf->ud = ud;
+    uf->excl = excl;
+    uf->raw = READ_ONCE(default_raw);
+    uf->timing.idle_us = READ_ONCE(rx_idle_us);
+    uf->rx_err_seen = READ_ONCE(ud->rx_err.events);  // Only errors from now on
+    file->private_data = uf;
+    
+    // read_iter/write_iter honour IOCB_NOWAIT
+    file->f_mode |= FMODE_NOWAIT;
+    
+    return stream_open(inode, file);
+}
+
+static int uart_release(struct inode *inode, struct file *file)
+{
+    struct uart_file *uf = file->private_data;
+    struct uart_dev *ud = uf->ud;
+    unsigned long flags;
+    bool gone;
+    
+    spin_lock_irqsave(&ud->lock, flags);
+    ud->open_count--;
+    ud->open_excl = false;  // Only the last file can have been exclusive
+    gone = ud->gone;
+    spin_unlock_irqrestore(&ud->lock, flags);
+    
+    // Unbind has dropped the runtime PM holds of files still open
+    if (!gone) {
+        uart_pm_release(ud);
+    }
+    kfree(uf);
+    uart_put(ud);
+    return 0;
+}
+
+// Map the RX ring: the rpi_uart_ring_header page, then the data.
+// A writable mapping lets the reader advance tail. Such a reader bypasses
+// rx_lock and becomes the consumer of every reader, so only a file that
+// holds the port with O_EXCL gets one; other files may map it read-only.
+// A mapping can outlive that file, so the ring helpers still range-check
+// the tail.
+static int uart_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct uart_file *uf = file->private_data;
+    struct uart_dev *ud = uf->ud;
+    int ret;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > UART_RX_MAP_SIZE) {
+        return -EINVAL;
+    }
+
+    if (!uf->excl) {
+        if (vma->vm_flags & VM_WRITE) {
+            return -EACCES;
+        }
+        vm_flags_clear(vma, VM_MAYWRITE);
+    }
+
+    ret = uart_io_begin(ud, false);
+    if (ret) {
+        return ret;
+    }
+
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    vm_flags_clear(vma, VM_MAYEXEC);
+    ret = remap_vmalloc_range(vma, ud->rx_ring.shared, 0);
+    if (!ret) {
+        // The mapping holds the ring until munmap()
+        vma->vm_private_data = ud;
+        vma->vm_ops = &uart_vm_ops;
+        kref_get(&ud->ref);
+    }
+
+    uart_io_end(ud);
+    return ret;
+}
+
+static const struct file_operations uart_fops = {
+    .owner = THIS_MODULE,
+    .open = uart_open,
+    .release = uart_release,
+    .read_iter = uart_read_iter,
+    .write_iter = uart_write_iter,
+    .poll = uart_poll,
+    .unlocked_ioctl = uart_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = uart_mmap,
+};
+
+// Queue a load/unload banner behind any pending TX data. It goes out
+// through the port's interrupt or DMA like written data, so nothing
+// waits for the line. tty ports get none, the line belongs to serial_core.
+static void uart_queue_banner(struct uart_dev *ud, const char *s)
+{
+    if (!READ_ONCE(banner)) {
+        return;
+    }
+
+    spin_lock_bh(&ud->tx_lock);
+    uart_ring_put_many(&ud->tx_ring, s, strlen(s));
+    spin_unlock_bh(&ud->tx_lock);
+    ud->backend->start_tx(ud);
+}
+
+// Kernel consumer API (rpi_uart_api.h). A client holds its port like an
+// O_EXCL open, so while attached it is the only RX consumer and its
+// submissions the only TX producer besides the banners.
+
+// Find a started port by /dev name, under uart_devs_lock
+static struct uart_dev *uart_find_dev(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < UART_MAX_PORTS; i++) {
+        if (uart_devs[i] && !strcmp(uart_devs[i]->name, name)) {
+            return uart_devs[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Hand everything in the RX ring to the client, in place
+static void uart_client_rx(struct uart_dev *ud, struct rpi_uart_client *client)
+{
+    struct uart_ring *r = &ud->rx_ring;
+    unsigned int tail = READ_ONCE(*uart_ring_tail(r));
+    unsigned int head, off, n;
+
+    while ((head = smp_load_acquire(&r->head)) != tail) {
+        off = tail & (r->size - 1);
+        n = min(head - tail, r->size - off);
+
+        client->rx(client->ctx, (const u8 *)r->buf + off, n);
+
+        tail += n;
+        smp_store_release(uart_ring_tail(r), tail);
+        trace_rpi_uart_rx_dequeue(ud->name, n, uart_ring_count(r));
+    }
+}
+
+// Call the done callbacks of submitted buffers. With status 0 only those
+// whose bytes have left tx_ring, otherwise all of them.
+static void uart_client_tx_done(struct uart_dev *ud, int status)
+{
+    unsigned int tail = smp_load_acquire(uart_ring_tail(&ud->tx_ring));
+    struct uart_tx_req req;
+
+    for (;;) {
+        spin_lock_bh(&ud->tx_lock);
+        if (ud->tx_req_tail == ud->tx_req_head) {
+            spin_unlock_bh(&ud->tx_lock);
+            break;
+        }
+        req = ud->tx_req[ud->tx_req_tail & (UART_TX_REQS - 1)];
+        if (!status && (int)(tail - req.end) < 0) {
+            spin_unlock_bh(&ud->tx_lock);
+            break;
+        }
+        WRITE_ONCE(ud->tx_req_tail, ud->tx_req_tail + 1);
+        spin_unlock_bh(&ud->tx_lock);
+
+        req.done(req.ctx, status);
+    }
+}
+
+static void uart_client_work(struct work_struct *work)
+{
+    struct uart_dev *ud = container_of(work, struct uart_dev, client_work);
+    // Cleared before the work is flushed, the client outlives this run
+    struct rpi_uart_client *client = READ_ONCE(ud->client);
+
+    if (client) {
+        uart_client_rx(ud, client);
+    }
+    uart_client_tx_done(ud, 0);
+}
+
+// Detach the port's client, under uart_devs_lock. Once this returns no
+// callback runs and no submission touches the port.
+static void uart_client_detach(struct uart_dev *ud)
+{
+    struct rpi_uart_client *client = ud->client;
+    unsigned long flags;
+
+    if (!client) {
+        return;
+    }
+
+    WRITE_ONCE(ud->client, NULL);
+    RCU_INIT_POINTER(client->ud, NULL);
+    synchronize_rcu();  // Submissions in progress are done
+    flush_work(&ud->client_work);
+
+    // Bytes still queued go out, their callbacks cannot wait for that
+    uart_client_tx_done(ud, 0);
+    uart_client_tx_done(ud, -ENODEV);
+    flush_work(&ud->client_work);  // A run the TX interrupt queued meanwhile
+
+    spin_lock_irqsave(&ud->lock, flags);
+    ud->open_count--;
+    ud->open_excl = false;
+    spin_unlock_irqrestore(&ud->lock, flags);
+
+    uart_pm_release(ud);
+}
+
+struct rpi_uart_client *rpi_uart_register_rx_cb(const char *name,
+                                                rpi_uart_rx_cb_t cb, void *ctx)
+{
+    struct rpi_uart_client *client;
+    struct uart_dev *ud;
+    unsigned long flags;
+    int ret = 0;
+
+    if (!cb) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if (!client) {
+        return ERR_PTR(-ENOMEM);
+    }
+    client->rx = cb;
+    client->ctx = ctx;
+
+    mutex_lock(&uart_devs_lock);
+    ud = uart_find_dev(name);
+    if (!ud) {
+        ret = -ENODEV;
+    } else if (ud->tty) {
+        ret = -EOPNOTSUPP;
+    } else {
+        ret = uart_pm_hold(ud);
+    }
+
+    if (!ret) {
+        // Claim the port like an O_EXCL open
+        spin_lock_irqsave(&ud->lock, flags);
+        if (ud->open_count) {
+            ret = -EBUSY;
+        } else {
+            ud->open_count++;
+            ud->open_excl = true;
+        }
+        spin_unlock_irqrestore(&ud->lock, flags);
+
+        if (ret) {
+            uart_pm_release(ud);
+        }
+    }
+
+    if (!ret) {
+        rcu_assign_pointer(client->ud, ud);
+        WRITE_ONCE(ud->client, client);
+        // Deliver what arrived before
+        queue_work(system_highpri_wq, &ud->client_work);
+    }
+    mutex_unlock(&uart_devs_lock);
+
+    if (ret) {
+        kfree(client);
+        return ERR_PTR(ret);
+    }
+
+    pr_debug("%s: kernel client attached\n", ud->name);
+    return client;
+}
+EXPORT_SYMBOL_GPL(rpi_uart_register_rx_cb);
+
+void rpi_uart_unregister_rx_cb(struct rpi_uart_client *client)
+{
+    struct uart_dev *ud;
+
+    mutex_lock(&uart_devs_lock);
+    ud = rcu_dereference_protected(client->ud, lockdep_is_held(&uart_devs_lock));
+    if (ud) {
+        uart_client_detach(ud);
+    }
+    mutex_unlock(&uart_devs_lock);
+
+    kfree(client);
+}
+EXPORT_SYMBOL_GPL(rpi_uart_unregister_rx_cb);
+
+int rpi_uart_submit_tx(struct rpi_uart_client *client, const void *buf, size_t len,
+                       rpi_uart_tx_done_t done, void *ctx)
+{
+    struct uart_tx_req *req;
+    struct uart_dev *ud;
+    unsigned int end = 0;
+    int ret = 0;
+
+    rcu_read_lock();
+    ud = rcu_dereference(client->ud);
+    if (!ud) {
+        ret = -ENODEV;
+        goto out;
+    }
+
+    if (!len || len > ud->tx_ring.size) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    // Whole or not at all, like a write up to atomic_write
+    spin_lock_bh(&ud->tx_lock);
+    if (!uart_tx_room(ud, len) ||
+        (done && ud->tx_req_head - ud->tx_req_tail >= UART_TX_REQS)) {
+        ret = -EAGAIN;
+    } else {
+        uart_ring_put_many(&ud->tx_ring, buf, len);
+        if (done) {
+            req = &ud->tx_req[ud->tx_req_head & (UART_TX_REQS - 1)];
+            req->end = end = ud->tx_ring.head;
+            req->done = done;
+            req->ctx = ctx;
+            // Published after the entry, uart_tx_freed() checks it locklessly
+            smp_store_release(&ud->tx_req_head, ud->tx_req_head + 1);
+        }
+    }
+    spin_unlock_bh(&ud->tx_lock);
+
+    if (!ret) {
+        trace_rpi_uart_tx_enqueue(ud->name, len, ud->tx_ring.size - uart_ring_space(&ud->tx_ring));
+        ud->backend->start_tx(ud);
+
+        // A running TX interrupt may have sent the bytes before the
+        // request was visible to it
+        smp_mb();
+        if (done && (int)(READ_ONCE(*uart_ring_tail(&ud->tx_ring)) - end) >= 0) {
+            queue_work(system_highpri_wq, &ud->client_work);
+        }
+    }
+out:
+    rcu_read_unlock();
+    return ret;
+}
+EXPORT_SYMBOL_GPL(rpi_uart_submit_tx);
+
+// Set up the rings, interrupt and /dev node for the misc device front end
+static int uart_chardev_init(struct uart_dev *ud)
+{
+    int ret;
+    
+    // Allocate the RX ring filled by the interrupt handler, behind a
+    // header page so it can be mmap()ed. The rings go with ud, open files
+    // may still use them after the port is stopped.
+    ud->rx_ring.shared = vmalloc_user(UART_RX_MAP_SIZE);
+    if (!ud->rx_ring.shared) {
+        return -ENOMEM;
+    }
+    ud->rx_ring.size = UART_RX_BUF_SIZE;
+    ud->rx_ring.buf = (char *)ud->rx_ring.shared + PAGE_SIZE;
+    ud->rx_ring.shared->size = ud->rx_ring.size;
+    ud->rx_ring.shared->data_offset = PAGE_SIZE;
+    
+    // RX timestamps follow the header in its page
+    BUILD_BUG_ON(sizeof(struct rpi_uart_ring_header) > UART_RX_STAMP_OFFSET);
+    BUILD_BUG_ON(UART_RX_STAMP_OFFSET + UART_RX_STAMPS * sizeof(struct rpi_uart_rx_stamp) > PAGE_SIZE);
+    ud->rx_stamps = (void *)ud->rx_ring.shared + UART_RX_STAMP_OFFSET;
+    ud->rx_ring.shared->stamp_count = UART_RX_STAMPS;
+    ud->rx_ring.shared->stamp_offset = UART_RX_STAMP_OFFSET;
+    
+    // Allocate the TX ring drained by the interrupt handler
+    ud->tx_ring.size = roundup_pow_of_two(clamp_val(tx_buf_size, UART_TX_BUF_MIN,
+                                                    UART_TX_BUF_MAX));
+    ud->tx_ring.buf = kmalloc(ud->tx_ring.size, GFP_KERNEL);
+    if (!ud->tx_ring.buf) {
+        return -ENOMEM;
+    }
+    
+    ret = ud->backend->startup(ud);
+    if (ret) {
+        return ret;
+    }
+    uart_set_irq_affinity(ud);
+    
+    // Create the /dev node for transmitting and receiving data
+    ud->miscdev.minor = MISC_DYNAMIC_MINOR;
+    ud->miscdev.name = ud->name;
+    ud->miscdev.fops = &uart_fops;
+    ud->miscdev.mode = 0666;
+    ret = misc_register(&ud->miscdev);
+    if (ret) {
+        pr_err("Failed to register /dev/%s\n", ud->name);
+        goto err_shutdown;
+    }
+    
+    pr_info("Read and write /dev/%s to receive and send data\n", ud->name);
+    return 0;
+
+err_shutdown:
+    uart_clear_irq_affinity(ud);
+    ud->backend->shutdown(ud);
+    uart_repin_irq_affinity(ud);
+    return ret;
+}
+
+static void uart_chardev_exit(struct uart_dev *ud)
+{
+    unsigned long flags;
+    unsigned int held;
+    
+    // Remove the device node so no new file can open
+    misc_deregister(&ud->miscdev);
+    
+    // Files still open fail from now on. Sleepers see gone, wait for
+    // every operation that got in before to finish.
+    spin_lock_irqsave(&ud->lock, flags);
+    ud->gone = true;
+    held = ud->open_count;
+    spin_unlock_irqrestore(&ud->lock, flags);
+    wake_up_all(&ud->rx_wait);
+    wake_up_all(&ud->tx_wait);
+    down_write(&ud->io_sem);
+    up_write(&ud->io_sem);
+    
+    // The runtime PM holds of those files, see uart_release()
+    if (ud->pm && !ud->wake_irq) {
+        while (held--) {
+            pm_runtime_put_noidle(ud->dev);
+        }
+    }
+    
+    // Let queued TX data and the banner go out before teardown, sleeping
+    // until the interrupt has drained the ring
+    uart_queue_banner(ud, "UART driver unloading...\r\n");
+    ud->backend->start_tx(ud);
+    if (wait_event_interruptible_timeout(ud->tx_wait, !uart_ring_count(&ud->tx_ring), HZ) <= 0)
+        pr_warn("%s TX: ring did not drain, discarding queued data\n", ud->name);
+    
+    // Stop interrupts and DMA, the rings stay until the last uart_put()
+    uart_clear_irq_affinity(ud);
+    ud->backend->shutdown(ud);
+    uart_repin_irq_affinity(ud);
+}
+
+// serial_core front end (tty=1) - the Mini UART is driven by the tty
+// layer, which provides termios, line disciplines and flip buffers, and
+// can be used as a kernel console with console=ttyMU0
+
+static struct uart_driver uart_serial_driver;
+static struct uart_dev *uart_serial_dev;
+
+static struct uart_dev *to_uart_dev(struct uart_port *port)
+{
+    return container_of(port, struct uart_dev, port);
+}
+
+// Push everything in the RX FIFO to the tty flip buffer
+static void uart_serial_rx_chars(struct uart_port *port)
+{
+    struct uart_dev *ud = to_uart_dev(port);
+    struct tty_port *tport = &port->state->port;
+    char burst[MU_FIFO_DEPTH];
+    unsigned int n, i;
+
+    // Overrun is latched in LSR, one read per interrupt is enough
+    if (readl(&ud->regs->MU_LSR) & MU_LSR_RX_OVERRUN) {
+        port->icount.overrun++;
+        this_cpu_inc(ud->stats->rx_overruns);
+        tty_insert_flip_char(tport, 0, TTY_OVERRUN);
+    }
+
+    while ((n = uart_rx_drain(ud, burst))) {
+        port->icount.rx += n;
+        this_cpu_add(ud->stats->rx_bytes, n);
+
+        for (i = 0; i < n; i++) {
+            if (uart_handle_sysrq_char(port, burst[i])) {
+                continue;
+            }
+
+            if (!(port->ignore_status_mask & MU_LSR_DATA_READY)) {
+                tty_insert_flip_char(tport, burst[i], TTY_NORMAL);
+            }
+        }
+    }
+
+    // One push per interrupt, the flip buffer batches delivery
+    tty_flip_buffer_push(tport);
+}
+
+static irqreturn_t uart_serial_irq(int irq, void *dev_id)
+{
+    struct uart_port *port = dev_id;
+    struct uart_dev *ud = to_uart_dev(port);
+    u32 iir = readl(&ud->regs->MU_IIR);
+    u8 ch;
+
+    // The AUX interrupt line is shared with SPI1/SPI2
+    if (iir & MU_IIR_NO_IRQ) {
+        return IRQ_NONE;
+    }
+
+    trace_rpi_uart_irq(ud->name, iir);
+    this_cpu_inc(ud->stats->irqs);
+
+    spin_lock(&port->lock);
+
+    uart_serial_rx_chars(port);
+
+    // One FIFO level read, then fill every free slot
+    if (READ_ONCE(ud->ier) & MU_IER_TX_IRQ) {
+        uart_port_tx_limited(port, ch, uart_tx_fifo_room(ud), true,
+                             writel(ch, &ud->regs->MU_IO), ({}));
+    }
+
+    spin_unlock(&port->lock);
+
+    return IRQ_HANDLED;
+}
+
+static unsigned int uart_serial_tx_empty(struct uart_port *port)
+{
+    return (readl(&to_uart_dev(port)->regs->MU_LSR) & MU_LSR_TX_IDLE) ? TIOCSER_TEMT : 0;
+}
+
+static void uart_serial_set_mctrl(struct uart_port *port, unsigned int mctrl)
+{
+    writel((mctrl & TIOCM_RTS) ? MU_MCR_RTS : 0, &to_uart_dev(port)->regs->MU_MCR);
+}
+
+static unsigned int uart_serial_get_mctrl(struct uart_port *port)
+{
+    unsigned int mctrl = TIOCM_CAR | TIOCM_DSR;
+
+    if (readl(&to_uart_dev(port)->regs->MU_MSR) & MU_MSR_CTS) {
+        mctrl |= TIOCM_CTS;
+    }
+
+    return mctrl;
+}
+
+static void uart_serial_stop_tx(struct uart_port *port)
+{
+    uart_set_ier(to_uart_dev(port), 0, MU_IER_TX_IRQ);
+}
+
+// The "TX empty" interrupt fires straight away and uart_port_tx() refills
+static void uart_serial_start_tx(struct uart_port *port)
+{
+    uart_set_ier(to_uart_dev(port), MU_IER_TX_IRQ, 0);
+}
+
+static void uart_serial_stop_rx(struct uart_port *port)
+{
+    uart_set_ier(to_uart_dev(port), 0, MU_IER_RX_IRQ);
+}
+
+static void uart_serial_break_ctl(struct uart_port *port, int break_state)
+{
+    struct uart_dev *ud = to_uart_dev(port);
+    unsigned long flags;
+    u32 lcr;
+
+    spin_lock_irqsave(&port->lock, flags);
+    lcr = readl(&ud->regs->MU_LCR);
+    if (break_state) {
+        lcr |= MU_LCR_BREAK;
+    } else {
+        lcr &= ~MU_LCR_BREAK;
+    }
+    writel(lcr, &ud->regs->MU_LCR);
+    spin_unlock_irqrestore(&port->lock, flags);
+}
+
+static int uart_serial_startup(struct uart_port *port)
+{
+    struct uart_dev *ud = to_uart_dev(port);
+    int ret;
+
+    ret = request_irq(port->irq, uart_serial_irq, IRQF_SHARED, "rpi_uart", port);
+    if (ret) {
+        return ret;
+    }
+    uart_set_irq_affinity(ud);
+
+    // Drop anything received while the port was closed
+    writel(MU_IIR_CLEAR_RX | MU_IIR_CLEAR_TX, &ud->regs->MU_IIR);
+    uart_set_ier(ud, MU_IER_REQUIRED | MU_IER_RX_IRQ, 0);
+
+    return 0;
+}
+
+static void uart_serial_shutdown(struct uart_port *port)
+{
+    struct uart_dev *ud = to_uart_dev(port);
+
+    uart_set_ier(ud, 0, ~0);
+    uart_clear_irq_affinity(ud);
+    free_irq(port->irq, port);
+    uart_repin_irq_affinity(ud);
+}
+
+// The Mini UART only does 7 or 8 data bits, no parity and one stop bit.
+// CRTSCTS maps to the hardware auto flow control when rtscts=1 has
+// given the port its RTS/CTS pins.
+static void uart_serial_set_termios(struct uart_port *port, struct ktermios *termios,
+                                    const struct ktermios *old)
+{
+    struct uart_dev *ud = to_uart_dev(port);
+    unsigned long flags;
+    unsigned int baud;
+    bool autoflow;
+    u32 lcr;
+
+    termios->c_cflag &= ~(CSTOPB | PARENB | PARODD | CMSPAR);
+    if (!ud->rtscts) {
+        termios->c_cflag &= ~CRTSCTS;
+    }
+    autoflow = termios->c_cflag & CRTSCTS;
+    if ((termios->c_cflag & CSIZE) == CS7) {
+        lcr = MU_LCR_7BIT;
+    } else {
+        termios->c_cflag = (termios->c_cflag & ~CSIZE) | CS8;
+        lcr = MU_LCR_8BIT;
+    }
+
+    // baud = clock / (8 * (divisor + 1)) with a 16-bit divisor
+    baud = uart_get_baud_rate(port, termios, old,
+                              DIV_ROUND_UP(port->uartclk, 8 * 0x10000),
+                              port->uartclk / 8);
+
+    spin_lock_irqsave(&port->lock, flags);
+
+    uart_update_timeout(port, termios->c_cflag, baud);
+
+    port->ignore_status_mask = 0;
+    if (!(termios->c_cflag & CREAD)) {
+        port->ignore_status_mask |= MU_LSR_DATA_READY;
+    }
+
+    writel(lcr, &ud->regs->MU_LCR);
+
+    port->status &= ~(UPSTAT_AUTORTS | UPSTAT_AUTOCTS);
+    if (autoflow) {
+        port->status |= UPSTAT_AUTORTS | UPSTAT_AUTOCTS;
+    }
+    writel(uart_mini_cntl(autoflow), &ud->regs->MU_CNTL);
+
+    spin_unlock_irqrestore(&port->lock, flags);
+
+    uart_set_baud(ud, baud);
+
+    if (tty_termios_baud_rate(termios)) {
+        tty_termios_encode_baud_rate(termios, baud, baud);
+    }
+}
+
+static const char *uart_serial_type(struct uart_port *port)
+{
+    return port->type == PORT_16550 ? "BCM2835 Mini UART" : NULL;
+}
+
+// The registers are mapped once at probe
+static void uart_serial_release_port(struct uart_port *port)
+{
+}
+
+static int uart_serial_request_port(struct uart_port *port)
+{
+    return 0;
+}
+
+static void uart_serial_config_port(struct uart_port *port, int flags)
+{
+    if (flags & UART_CONFIG_TYPE) {
+        port->type = PORT_16550;
+    }
+}
+
+static int uart_serial_verify_port(struct uart_port *port, struct serial_struct *ser)
+{
+    if (ser->type != PORT_UNKNOWN && ser->type != PORT_16550) {
+        return -EINVAL;
+    }
+    if (ser->irq != port->irq) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const struct uart_ops uart_serial_ops = {
+    .tx_empty = uart_serial_tx_empty,
+    .set_mctrl = uart_serial_set_mctrl,
+    .get_mctrl = uart_serial_get_mctrl,
+    .stop_tx = uart_serial_stop_tx,
+    .start_tx = uart_serial_start_tx,
+    .stop_rx = uart_serial_stop_rx,
+    .break_ctl = uart_serial_break_ctl,
+    .startup = uart_serial_startup,
+    .shutdown = uart_serial_shutdown,
+    .set_termios = uart_serial_set_termios,
+    .type = uart_serial_type,
+    .release_port = uart_serial_release_port,
+    .request_port = uart_serial_request_port,
+    .config_port = uart_serial_config_port,
+    .verify_port = uart_serial_verify_port,
+};
+
+// Console output is polled so it works from any context, including oopses
+static void uart_console_putchar(struct uart_port *port, unsigned char ch)
+{
+    struct uart_dev *ud = to_uart_dev(port);
+
+    while (!(readl(&ud->regs->MU_LSR) & MU_LSR_TX_EMPTY)) {
+        cpu_relax();
+    }
+    writel(ch, &ud->regs->MU_IO);
+}
+
+static void uart_console_write_msg(struct console *co, const char *s, unsigned int count)
+{
+    struct uart_port *port = &uart_serial_dev->port;
+    unsigned long flags;
+    int locked = 1;
+
+    if (oops_in_progress) {
+        locked = spin_trylock_irqsave(&port->lock, flags);
+    } else {
+        spin_lock_irqsave(&port->lock, flags);
+    }
+
+    uart_console_write(port, s, count, uart_console_putchar);
+
+    if (locked) {
+        spin_unlock_irqrestore(&port->lock, flags);
+    }
+}
+
+static int uart_console_setup(struct console *co, char *options)
+{
+    int baud;
+    int bits = 8;
+    int parity = 'n';
+    int flow = 'n';
+
+    if (!uart_serial_dev) {
+        return -ENODEV;
+    }
+
+    baud = uart_serial_dev->baud;
+    if (options) {
+        uart_parse_options(options, &baud, &parity, &bits, &flow);
+    }
+
+    return uart_set_options(&uart_serial_dev->port, co, baud, parity, bits, flow);
+}
+
+static struct console uart_console = {
+    .name = UART_TTY_NAME,
+    .write = uart_console_write_msg,
+    .device = uart_console_device,
+    .setup = uart_console_setup,
+    .flags = CON_PRINTBUFFER,
+    .index = -1,
+    .data = &uart_serial_driver,
+};
+
+static struct uart_driver uart_serial_driver = {
+    .owner = THIS_MODULE,
+    .driver_name = "rpi_uart",
+    .dev_name = UART_TTY_NAME,
+    .nr = 1,
+    .cons = &uart_console,
+};
+
+// Register the Mini UART with serial_core as /dev/ttyMU0
+static int uart_serial_init(struct uart_dev *ud)
+{
+    struct uart_port *port = &ud->port;
+    int ret;
+
+    ret = uart_register_driver(&uart_serial_driver);
+    if (ret) {
+        pr_err("Failed to register serial driver\n");
+        return ret;
+    }
+
+    port->dev = ud->dev;
+    port->membase = (void __iomem *)&ud->regs->MU_IO;
+    port->mapbase = ud->phys;
+    port->mapsize = MU_REG_SIZE;
+    port->iotype = UPIO_MEM32;
+    port->irq = ud->irq;
+    port->uartclk = ud->clock_rate;
+    port->fifosize = MU_FIFO_DEPTH;
+    port->ops = &uart_serial_ops;
+    port->type = PORT_16550;
+    port->flags = UPF_FIXED_PORT | UPF_FIXED_TYPE;
+    port->line = 0;
+
+    // The console may be set up as soon as the port is added
+    uart_serial_dev = ud;
+    ret = uart_add_one_port(&uart_serial_driver, port);
+    if (ret) {
+        pr_err("Failed to add serial port\n");
+        goto err_driver;
+    }
+
+    pr_info("Mini UART registered as /dev/%s0\n", UART_TTY_NAME);
+    return 0;
+
+err_driver:
+    uart_serial_dev = NULL;
+    uart_unregister_driver(&uart_serial_driver);
+    return ret;
+}
+
+static void uart_serial_exit(struct uart_dev *ud)
+{
+    uart_remove_one_port(&uart_serial_driver, &ud->port);
+    uart_serial_dev = NULL;
+    uart_unregister_driver(&uart_serial_driver);
+}
+
+// Sum the per-CPU statistics of a port
+static void uart_stats_sum(struct uart_dev *ud, struct uart_stats *sum)
+{
+    const struct uart_stats *s;
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(ud->stats, cpu);
+        sum->rx_bytes += READ_ONCE(s->rx_bytes);
+        sum->tx_bytes += READ_ONCE(s->tx_bytes);
+        sum->rx_dropped += READ_ONCE(s->rx_dropped);
+        sum->rx_overruns += READ_ONCE(s->rx_overruns);
+        sum->rx_framing_errors += READ_ONCE(s->rx_framing_errors);
+        sum->rx_parity_errors += READ_ONCE(s->rx_parity_errors);
+        sum->rx_breaks += READ_ONCE(s->rx_breaks);
+        sum->irqs += READ_ONCE(s->irqs);
+        sum->rx_polls += READ_ONCE(s->rx_polls);
+        sum->tx_wait_us += READ_ONCE(s->tx_wait_us);
+        sum->rx_frames += READ_ONCE(s->rx_frames);
+        sum->rx_bad_frames += READ_ONCE(s->rx_bad_frames);
+        sum->pm_suspends += READ_ONCE(s->pm_suspends);
+        sum->pm_wakeups += READ_ONCE(s->pm_wakeups);
+        sum->pm_wake_us += READ_ONCE(s->pm_wake_us);
+        sum->pm_wake_max_us = max(sum->pm_wake_max_us, READ_ONCE(s->pm_wake_max_us));
+        sum->rx_high = max(sum->rx_high, READ_ONCE(s->rx_high));
+        sum->tx_high = max(sum->tx_high, READ_ONCE(s->tx_high));
+    }
+}
+
+// /sys/kernel/debug/rpi_uart/<name>, one "name value" pair per line
+static int uart_stats_show(struct seq_file *m, void *v)
+{
+    struct uart_dev *ud = m->private;
+    struct uart_stats sum;
+
+    uart_stats_sum(ud, &sum);
+
+    seq_printf(m, "rx_bytes %lu\n", sum.rx_bytes);
+    seq_printf(m, "tx_bytes %lu\n", sum.tx_bytes);
+    seq_printf(m, "rx_dropped %lu\n", sum.rx_dropped);
+    seq_printf(m, "rx_overruns %lu\n", sum.rx_overruns);
+    seq_printf(m, "rx_framing_errors %lu\n", sum.rx_framing_errors);
+    seq_printf(m, "rx_parity_errors %lu\n", sum.rx_parity_errors);
+    seq_printf(m, "rx_breaks %lu\n", sum.rx_breaks);
+    seq_printf(m, "irqs %lu\n", sum.irqs);
+    seq_printf(m, "rx_polls %lu\n", sum.rx_polls);
+    seq_printf(m, "tx_wait_us %lu\n", sum.tx_wait_us);
+    seq_printf(m, "rx_frames %lu\n", sum.rx_frames);
+    seq_printf(m, "rx_bad_frames %lu\n", sum.rx_bad_frames);
+    seq_printf(m, "rx_high %u/%u\n", sum.rx_high, ud->rx_ring.size);
+    seq_printf(m, "tx_high %u/%u\n", sum.tx_high, ud->tx_ring.size);
+    seq_printf(m, "pm_suspends %lu\n", sum.pm_suspends);
+    seq_printf(m, "pm_wakeups %lu\n", sum.pm_wakeups);
+    seq_printf(m, "pm_wake_us %lu\n", sum.pm_wake_us);
+    seq_printf(m, "pm_wake_max_us %u\n", sum.pm_wake_max_us);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(uart_stats);
+
+// Defaults shared by device tree and pl011= ports
+static void uart_dev_init(struct uart_dev *ud, const struct uart_backend *be,
+                          int index, unsigned int slot)
+{
+    ud->backend = be;
+    ud->index = index;
+    ud->slot = slot;
+    ud->irq_cpu = irq_cpus[slot];
+    ud->tty = use_tty && be == &uart_mini_backend;
+    ud->baud = uart_baud;
+    snprintf(ud->name, sizeof(ud->name), be->dev_name, index);
+    spin_lock_init(&ud->lock);
+    spin_lock_init(&ud->tx_lock);
+    spin_lock_init(&ud->rx_lock);
+    spin_lock_init(&ud->rx_err_lock);
+    init_waitqueue_head(&ud->rx_wait);
+    init_waitqueue_head(&ud->tx_wait);
+    INIT_WORK(&ud->client_work, uart_client_work);
+    kref_init(&ud->ref);  // The port's own, dropped after uart_stop_dev()
+    init_rwsem(&ud->io_sem);
+}
+
+// Start the front end of a probed port and make it visible to baud=
+static int uart_start_dev(struct uart_dev *ud)
+{
+    int ret;
+
+    ret = ud->tty ? uart_serial_init(ud) : uart_chardev_init(ud);
+    if (ret) {
+        return ret;
+    }
+
+    // Send a test message
+    if (!ud->tty) {
+        uart_queue_banner(ud, "UART driver loaded successfully!\r\n");
+    }
+
+    ud->debugfs = debugfs_create_file(ud->name, 0444, uart_debugfs_dir, ud, &uart_stats_fops);
+
+    mutex_lock(&uart_devs_lock);
+    uart_devs[ud->slot] = ud;
+    mutex_unlock(&uart_devs_lock);
+    return 0;
+}
+
+static void uart_stop_dev(struct uart_dev *ud)
+{
+    struct uart_stats sum;
+
+    mutex_lock(&uart_devs_lock);
+    uart_devs[ud->slot] = NULL;
+    uart_client_detach(ud);
+    mutex_unlock(&uart_devs_lock);
+
+    debugfs_remove(ud->debugfs);
+
+    if (ud->tty) {
+        uart_serial_exit(ud);
+    } else {
+        uart_chardev_exit(ud);
+    }
+
+    // TX interrupts of the last drain may have queued it again
+    cancel_work_sync(&ud->client_work);
+
+    ud->backend->remove(ud);
+
+    uart_stats_sum(ud, &sum);
+    if (sum.rx_dropped)
+        pr_warn("%s RX: %lu bytes dropped on full ring\n", ud->name, sum.rx_dropped);
+    pr_info("%s: %lu bytes received, %lu bytes sent\n", ud->name, sum.rx_bytes, sum.tx_bytes);
+}
+
+// Runtime PM of the Mini UART: once the port has been idle for the
+// autosuspend delay its AUX clock is gated, and TX or the wake-up
+// interrupt brings it back. The receiver is off from the wake-up edge
+// until resume has run, pm_wake_max_us in debugfs; unless sender and
+// delay allow for that, the first byte after a gap is lost.
+static int uart_mini_runtime_suspend(struct device *dev)
+{
+    struct uart_dev *ud = dev_get_drvdata(dev);
+    unsigned int drain_us = DIV_ROUND_UP((MU_FIFO_DEPTH + 1) * 10 * USEC_PER_SEC, READ_ONCE(ud->baud));
+    unsigned long flags;
+    bool busy;
+    u32 stat;
+
+    // The FIFO is still shifting out for a while after the TX ring drained.
+    // MU_STAT, as reading MU_LSR would clear an overrun.
+    if (readl_poll_timeout(&ud->regs->MU_STAT, stat, stat & MU_STAT_TX_DONE, 10, drain_us)) {
+        goto busy;
+    }
+
+    spin_lock_irqsave(&ud->lock, flags);
+    busy = (ud->ier & MU_IER_TX_IRQ) || uart_tx_pending(ud) || ud->rx_polling ||
+           MU_STAT_RX_LEVEL(readl(&ud->regs->MU_STAT));
+    if (!busy) {
+        WRITE_ONCE(ud->suspended, true);
+        writel(0x0, &ud->regs->MU_IER);
+    }
+    spin_unlock_irqrestore(&ud->lock, flags);
+
+    if (busy) {
+        goto busy;
+    }
+
+    // The handler has seen suspended before the registers go away. One
+    // that was already running may have switched RX to polling.
+    synchronize_irq(ud->irq);
+    if (READ_ONCE(ud->rx_polling)) {
+        spin_lock_irqsave(&ud->lock, flags);
+        WRITE_ONCE(ud->suspended, false);
+        writel(ud->ier, &ud->regs->MU_IER);
+        spin_unlock_irqrestore(&ud->lock, flags);
+        goto busy;
+    }
+
+    clk_disable_unprepare(ud->clk);
+    this_cpu_inc(ud->stats->pm_suspends);
+
+    // A no-op unless device tree has an "idle" pinctrl state
+    pinctrl_pm_select_idle_state(dev);
+
+    // Not running yet, the interrupt is still disabled
+    if (ud->wake_irq) {
+        ud->wake_armed = true;
+        enable_irq(ud->wake_irq);
+    }
+    return 0;
+
+busy:
+    // Retried after the delay, or by the TX interrupt once the ring drains
+    pm_runtime_mark_last_busy(dev);
+    return -EBUSY;
+}
+
+static int uart_mini_runtime_resume(struct device *dev)
+{
+    struct uart_dev *ud = dev_get_drvdata(dev);
+    unsigned long flags;
+    unsigned int us;
+    ktime_t edge;
+    int ret;
+
+    pinctrl_pm_select_default_state(dev);
+
+    ret = clk_prepare_enable(ud->clk);
+    if (ret) {
+        return ret;
+    }
+
+    spin_lock_irqsave(&ud->lock, flags);
+    WRITE_ONCE(ud->suspended, false);
+    spin_unlock_irqrestore(&ud->lock, flags);
+
+    writel(0x0, &ud->regs->MU_CNTL);
+    if (uart_mini_config(ud)) {
+        pr_warn("%s: %u baud not reachable after resume\n", ud->name, ud->baud);
+    }
+
+    // Interrupts as they were, with the TX bit of writes queued meanwhile
+    spin_lock_irqsave(&ud->lock, flags);
+    if (ud->wake_armed) {
+        ud->wake_armed = false;
+        disable_irq_nosync(ud->wake_irq);
+    }
+    edge = ud->wake_edge;
+    ud->wake_edge = 0;
+    writel(ud->ier, &ud->regs->MU_IER);
+    spin_unlock_irqrestore(&ud->lock, flags);
+
+    if (edge) {
+        us = ktime_us_delta(ktime_get(), edge);
+        this_cpu_inc(ud->stats->pm_wakeups);
+        this_cpu_add(ud->stats->pm_wake_us, us);
+        uart_stat_max(ud, pm_wake_max_us, us);
+    }
+
+    pm_runtime_mark_last_busy(dev);
+    return 0;
+}
+
+static const struct dev_pm_ops uart_mini_pm_ops = {
+    RUNTIME_PM_OPS(uart_mini_runtime_suspend, uart_mini_runtime_resume, NULL)
+};
+
+// Edge on the RX line while suspended: the first start bit
+static irqreturn_t uart_wake_irq_handler(int irq, void *dev_id)
+{
+    struct uart_dev *ud = dev_id;
+
+    spin_lock(&ud->lock);
+    if (ud->wake_armed) {
+        ud->wake_armed = false;
+        ud->wake_edge = ktime_get();
+        disable_irq_nosync(irq);
+    }
+    spin_unlock(&ud->lock);
+
+    pm_request_resume(ud->dev);
+    return IRQ_HANDLED;
+}
+
+static void uart_put_action(void *data)
+{
+    uart_put(data);
+}
+
+// devm action, teardown holds the port powered
+static void uart_mini_clk_off(void *data)
+{
+    struct uart_dev *ud = data;
+
+    if (!ud->suspended) {
+        clk_disable_unprepare(ud->clk);
+    }
+}
+
+// Mini UART from device tree. MMIO, interrupt and clock all come from
+// the node, so nothing depends on the SoC's peripheral base, and probe
+// can run asynchronously or be deferred until the clock is ready.
+static int uart_mini_platform_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    struct uart_dev *ud;
+    struct resource *res;
+    void __iomem *base;
+    struct clk *clk;
+    int ret;
+
+    // Not devm: open files can hold ud past unbind. Its reference is
+    // dropped by the first devm action, so after all the others.
+    ud = kzalloc(sizeof(*ud), GFP_KERNEL);
+    if (!ud) {
+        return -ENOMEM;
+    }
+
+    uart_dev_init(ud, &uart_mini_backend, 0, UART_MINI_SLOT);
+    ud->dev = dev;
+
+    ret = devm_add_action_or_reset(dev, uart_put_action, ud);
+    if (ret) {
+        return ret;
+    }
+
+    ud->stats = alloc_percpu(struct uart_stats);
+    if (!ud->stats) {
+        return -ENOMEM;
+    }
+
+    // The node's registers start at MU_IO. AUX_IRQ and AUX_ENABLES belong
+    // to the aux clock driver and are never accessed through regs.
+    base = devm_platform_get_and_ioremap_resource(pdev, 0, &res);
+    if (IS_ERR(base)) {
+        return PTR_ERR(base);
+    }
+    ud->regs = (struct uart_regs __iomem *)(base - offsetof(struct uart_regs, MU_IO));
+    ud->phys = res->start;
+
+    ud->irq = platform_get_irq(pdev, 0);
+    if (ud->irq < 0) {
+        return ud->irq;
+    }
+
+    // The clock is the Mini UART's AUX enable gate, its rate the VPU core
+    // clock. Runtime PM turns it off and on.
+    clk = devm_clk_get(dev, NULL);
+    if (IS_ERR(clk)) {
+        return dev_err_probe(dev, PTR_ERR(clk), "cannot get clock\n");
+    }
+
+    ret = clk_prepare_enable(clk);
+    if (ret) {
+        return dev_err_probe(dev, ret, "cannot enable clock\n");
+    }
+
+    // devm owns this reference, uart_put_clock() is never called for it
+    ud->clk = clk;
+    ret = devm_add_action_or_reset(dev, uart_mini_clk_off, ud);
+    if (ret) {
+        return ret;
+    }
+    ud->clock_rate = clk_get_rate(clk) ?: UART_SYSTEM_CLOCK;
+    ud->clk_nb.notifier_call = uart_clk_notify;
+    if (devm_clk_notifier_register(dev, clk, &ud->clk_nb)) {
+        dev_warn(dev, "cannot follow clock rate changes\n");
+    }
+
+    ud->mux_pins = !of_property_present(dev->of_node, "pinctrl-0");
+    ud->rtscts = use_rtscts;
+
+    // An optional "wakeup" interrupt, e.g. a falling edge of GPIO15
+    // (RXD1), lets the port suspend while it is open
+    ret = platform_get_irq_byname_optional(pdev, "wakeup");
+    if (ret == -EPROBE_DEFER) {
+        return ret;
+    }
+    if (ret > 0) {
+        ud->wake_irq = ret;
+        ret = devm_request_irq(dev, ud->wake_irq, uart_wake_irq_handler, IRQF_NO_AUTOEN,
+                               "rpi_uart-wake", ud);
+        if (ret) {
+            return dev_err_probe(dev, ret, "cannot request wake-up IRQ %d\n", ud->wake_irq);
+        }
+    }
+
+    ret = ud->backend->probe(ud);
+    if (ret) {
+        return ret;
+    }
+
+    // Before the /dev node exists, so every open sees the same ud->pm.
+    // The driver core lets the port idle once probe returns.
+    platform_set_drvdata(pdev, ud);
+    if (!ud->tty) {
+        pm_runtime_set_autosuspend_delay(dev, autosuspend_ms);
+        pm_runtime_use_autosuspend(dev);
+        pm_runtime_set_active(dev);
+        ret = devm_pm_runtime_enable(dev);
+        if (ret) {
+            ud->backend->remove(ud);
+            return ret;
+        }
+        ud->pm = true;
+    }
+
+    ret = uart_start_dev(ud);
+    if (ret) {
+        ud->backend->remove(ud);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void uart_mini_platform_remove(struct platform_device *pdev)
+{
+    // Teardown drains TX and stops the registers, the port stays powered
+    // from here until devm has disabled runtime PM. The usage count is
+    // dropped again without idling, or a rebind would never autosuspend.
+    pm_runtime_get_sync(&pdev->dev);
+    uart_stop_dev(platform_get_drvdata(pdev));
+    pm_runtime_put_noidle(&pdev->dev);
+}
+
+static const struct of_device_id uart_mini_of_match[] = {
+    { .compatible = "brcm,bcm2835-aux-uart" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, uart_mini_of_match);
+
+static struct platform_driver uart_mini_driver = {
+    .probe = uart_mini_platform_probe,
+    .remove_new = uart_mini_platform_remove,
+    .driver = {
+        .name = "rpi_uart",
+        .of_match_table = uart_mini_of_match,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
+        .pm = pm_ptr(&uart_mini_pm_ops),
+    },
+};
+
+// Bring up a PL011 from the pl011= parameter
+static int uart_add_pl011(unsigned int slot, int index)
+{
+    struct uart_dev *ud;
+    int ret;
+
+    ud = kzalloc(sizeof(*ud), GFP_KERNEL);
+    if (!ud) {
+        return -ENOMEM;
+    }
+
+    uart_dev_init(ud, &pl011_backend, index, slot);
+
+    ud->stats = alloc_percpu(struct uart_stats);
+    if (!ud->stats) {
+        ret = -ENOMEM;
+        goto err_put;
+    }
+
+    ret = ud->backend->probe(ud);
+    if (ret) {
+        goto err_put;
+    }
+
+    ret = uart_start_dev(ud);
+    if (ret) {
+        goto err_remove;
+    }
+
+    return 0;
+
+err_remove:
+    ud->backend->remove(ud);
+err_put:
+    uart_put(ud);
+    return ret;
+}
+
+static void uart_remove_pl011s(void)
+{
+    struct uart_dev *ud;
+    unsigned int i;
+
+    for (i = UART_MAX_PORTS - 1; i > UART_MINI_SLOT; i--) {
+        ud = uart_devs[i];
+        if (ud) {
+            uart_stop_dev(ud);
+            uart_put(ud);
+        }
+    }
+}
+
+// Map the GPIO block from device tree so pin muxing works on BCM2835/7
+// and BCM2711 alike, GPIO_BASE of the board profile is the fallback
+static int uart_map_gpio(void)
+{
+    struct device_node *np;
+
+    np = of_find_compatible_node(NULL, NULL, "brcm,bcm2711-gpio");
+    gpio_has_pupdn = np != NULL;
+    if (!np) {
+        np = of_find_compatible_node(NULL, NULL, "brcm,bcm2835-gpio");
+    }
+
+    if (np) {
+        gpio = of_iomap(np, 0);
+        of_node_put(np);
+    } else {
+        gpio_has_pupdn = GPIO_HAS_PUPPDN;
+        gpio = ioremap(GPIO_BASE, 0x1000);
+    }
+
+    if (!gpio) {
+        pr_err("Failed to map GPIO registers\n");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// Whether a pin configuration node of the BCM283x pinctrl binding
+// names GPIO14 or GPIO15, in "brcm,pins" or generic "pins"
+static bool uart_pinconf_has_gpio14(struct device_node *np)
+{
+    int n = of_property_count_u32_elems(np, "brcm,pins");
+    u32 pin;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (!of_property_read_u32_index(np, "brcm,pins", i, &pin) && (pin == 14 || pin == 15)) {
+            return true;
+        }
+    }
+
+    return of_property_match_string(np, "pins", "gpio14") >= 0 ||
+           of_property_match_string(np, "pins", "gpio15") >= 0;
+}
+
+// Whether the Mini UART will take GPIO14/15, the pins of PL011 UART0:
+// it muxes them itself without a pinctrl-0 state, otherwise its state
+// (or one of the state's subnodes) lists them
+static bool uart_mini_uses_gpio14(void)
+{
+    struct device_node *np, *cfg, *child;
+    bool used = false;
+    int i;
+
+    np = of_find_compatible_node(NULL, NULL, "brcm,bcm2835-aux-uart");
+    if (!np || !of_device_is_available(np)) {
+        of_node_put(np);
+        return false;
+    }
+
+    if (!of_property_present(np, "pinctrl-0")) {
+        of_node_put(np);
+        return true;
+    }
+
+    for (i = 0; !used && (cfg = of_parse_phandle(np, "pinctrl-0", i)); i++) {
+        used = uart_pinconf_has_gpio14(cfg);
+        for_each_child_of_node(cfg, child) {
+            if (!used) {
+                used = uart_pinconf_has_gpio14(child);
+            }
+        }
+        of_node_put(cfg);
+    }
+
+    of_node_put(np);
+    return used;
+}
+
+// Module initialization
+static int __init uart_driver_init(void)
+{
+    unsigned int i, j;
+    int ret;
+
+    if (!use_mini && !num_pl011) {
+        pr_err("No UART selected, use mini=1 or pl011=\n");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < num_pl011; i++) {
+        for (j = 0; j < i; j++) {
+            if (pl011_ports[i] == pl011_ports[j]) {
+                pr_err("PL011 UART%d given twice\n", pl011_ports[i]);
+                return -EINVAL;
+            }
+        }
+
+        // Both would mux GPIO14/15 and the last one probed wins
+        if (pl011_ports[i] == 0 && use_mini && uart_mini_uses_gpio14()) {
+            pr_err("PL011 UART0 and the Mini UART both use GPIO14/15, use mini=0\n");
+            return -EBUSY;
+        }
+    }
+
+    ret = uart_map_gpio();
+    if (ret) {
+        return ret;
+    }
+
+    // Statistics are optional, debugfs reports its own errors
+    uart_debugfs_dir = debugfs_create_dir("rpi_uart", NULL);
+
+    for (i = 0; i < num_pl011; i++) {
+        ret = uart_add_pl011(UART_MINI_SLOT + 1 + i, pl011_ports[i]);
+        if (ret) {
+            goto err_remove;
+        }
+    }
+
+    // The Mini UART probes, possibly asynchronously, once its node is matched
+    if (use_mini) {
+        ret = platform_driver_register(&uart_mini_driver);
+        if (ret) {
+            goto err_remove;
+        }
+    }
+
+    pr_info("UART driver loaded.\n");
+    return 0;
+
+err_remove:
+    uart_remove_pl011s();
+    debugfs_remove_recursive(uart_debugfs_dir);
+    iounmap(gpio);
+    return ret;
+}
+
+// Module cleanup
+static void __exit uart_driver_exit(void)
+{
+    if (use_mini) {
+        platform_driver_unregister(&uart_mini_driver);
+    }
+    uart_remove_pl011s();
+    debugfs_remove_recursive(uart_debugfs_dir);
+
+    // Unmap registers
+    if (gpio)
+        iounmap(gpio);
+
     pr_info("UART driver unloaded.\n");
 }
 
@@ -303,4 +4312,4 @@ module_exit(uart_driver_exit);
 
 MODULE_AUTHOR("Supriya Mishra");
 MODULE_LICENSE("GPL");
-MODULE_DESCRIPTION("BCM2711 Mini UART Driver");
+MODULE_DESCRIPTION("BCM2711 Mini UART and PL011 Driver");
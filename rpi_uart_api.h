@@ -0,0 +1,44 @@
+#ifndef RPI_UART_API_H
+#define RPI_UART_API_H
+
+// In-kernel interface of rpi_uart, for protocol modules (GNSS/NMEA,
+// sensor fusion) that consume a port's byte stream directly instead of
+// through its /dev node. A client claims the port like an O_EXCL open:
+// registering fails with -EBUSY while the /dev node is open, and the
+// node cannot be opened while the client is registered. tty=1 ports
+// belong to serial_core and are not available.
+
+#include <linux/types.h>
+
+struct rpi_uart_client;
+
+// Received bytes, called from the port's work item (process context, may
+// sleep). buf points into the RX ring and is only valid during the call;
+// one burst may arrive in two calls where it wraps around the ring.
+typedef void (*rpi_uart_rx_cb_t)(void *ctx, const u8 *buf, size_t len);
+
+// A submitted buffer has been handed to the hardware (status 0), or the
+// client is going away first (-ENODEV). Called from the port's work item
+// or from rpi_uart_unregister_rx_cb().
+typedef void (*rpi_uart_tx_done_t)(void *ctx, int status);
+
+// Attach to a port by its /dev name, e.g. "ttyMU0" or "ttyPL2". Returns
+// the client or an ERR_PTR(): -ENODEV if there is no such port (yet),
+// -EBUSY if it is open or has a client, -EOPNOTSUPP for tty ports.
+struct rpi_uart_client *rpi_uart_register_rx_cb(const char *name,
+                                                rpi_uart_rx_cb_t cb, void *ctx);
+
+// Detach and free the client. No callback runs after this returns. If the
+// port was removed first, it only frees the client.
+void rpi_uart_unregister_rx_cb(struct rpi_uart_client *client);
+
+// Queue len bytes whole, without sleeping; callable from process and
+// softirq context but not hard interrupt context. buf may be reused on
+// return, done (optional) is called once the bytes have left the TX ring.
+// Returns 0, -EAGAIN if the ring or the completion queue is full (retry
+// from a done callback), -EINVAL if len is 0 or above the ring size, or
+// -ENODEV once the port has been removed.
+int rpi_uart_submit_tx(struct rpi_uart_client *client, const void *buf, size_t len,
+                       rpi_uart_tx_done_t done, void *ctx);
+
+#endif
@@ -0,0 +1,497 @@
+// rpi_uart_bench - throughput and latency of an rpi_uart port
+//
+// Loops the port's TX back to its RX, either inside the UART (-L, PL011
+// ports) or through a jumper wire between the TX and RX pins (e.g.
+// GPIO14 and GPIO15 for ttyMU0), and for every baud rate and write size
+// reports:
+//
+//   - sustained throughput of a checked byte stream, and its share of
+//     the line rate (10 bits per byte)
+//   - p50/p99/p999 round-trip latency of short messages
+//   - CPU time of the whole system per MB moved, from /proc/stat, so
+//     interrupt and softirq time is included
+//   - RX overruns and ring drops, from the port's debugfs statistics
+//     (needs debugfs mounted and read access, shown as "-" otherwise)
+//
+// Build with "make bench". Example:
+//
+//   ./rpi_uart_bench -d /dev/ttyPL2 -L -b 115200,921600,3000000 -s 64,4096
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpi_uart_ioctl.h"
+
+#define BENCH_MAX_LIST   16
+#define BENCH_READ_SIZE  4096
+#define BENCH_DRAIN_US   50000     // Line quiet this long = nothing left in flight
+
+struct bench_opts {
+    const char *dev;
+    unsigned int bauds[BENCH_MAX_LIST];
+    unsigned int num_bauds;
+    unsigned int sizes[BENCH_MAX_LIST];
+    unsigned int num_sizes;
+    unsigned int seconds;       // Per throughput and per latency run
+    unsigned int samples;       // Latency round trips per run
+    unsigned int msg_size;      // Bytes per latency round trip
+    int loopback;
+};
+
+// Counters from debugfs, -1 when not readable
+struct bench_stats {
+    long rx_overruns;
+    long rx_dropped;
+};
+
+struct bench_writer {
+    int fd;
+    unsigned int size;
+    double end;                 // Stop writing at this time
+    unsigned long long sent;
+    int error;
+};
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse a comma separated list of positive numbers
+static int bench_parse_list(const char *arg, unsigned int *list, unsigned int *num)
+{
+    char *end;
+    unsigned long val;
+
+    *num = 0;
+    do {
+        val = strtoul(arg, &end, 0);
+        if (end == arg || !val || *num == BENCH_MAX_LIST || (*end && *end != ',')) {
+            return -1;
+        }
+        list[(*num)++] = val;
+        arg = end + 1;
+    } while (*end);
+
+    return 0;
+}
+
+// Busy and total CPU ticks of all CPUs
+static int bench_cpu_ticks(unsigned long long *busy, unsigned long long *total)
+{
+    unsigned long long v[8] = { 0 };
+    FILE *f;
+    int n;
+
+    f = fopen("/proc/stat", "r");
+    if (!f) {
+        return -1;
+    }
+    // user nice system idle iowait irq softirq steal
+    n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+    fclose(f);
+    if (n < 4) {
+        return -1;
+    }
+
+    *total = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+    *busy = *total - v[3] - v[4];
+    return 0;
+}
+
+// Read the port's statistics from /sys/kernel/debug/rpi_uart/<name>
+static void bench_read_stats(const char *dev, struct bench_stats *st)
+{
+    const char *name = strrchr(dev, '/');
+    char path[256];
+    char key[32];
+    long val;
+    FILE *f;
+
+    st->rx_overruns = -1;
+    st->rx_dropped = -1;
+
+    snprintf(path, sizeof(path), "/sys/kernel/debug/rpi_uart/%s", name ? name + 1 : dev);
+    f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+
+    while (fscanf(f, "%31s %ld%*[^\n]", key, &val) == 2) {
+        if (!strcmp(key, "rx_overruns")) {
+            st->rx_overruns = val;
+        } else if (!strcmp(key, "rx_dropped")) {
+            st->rx_dropped = val;
+        }
+    }
+    fclose(f);
+}
+
+static void bench_print_delta(long before, long after)
+{
+    if (before < 0 || after < 0) {
+        printf(" %9s", "-");
+    } else {
+        printf(" %9ld", after - before);
+    }
+}
+
+// A blocking read returns after timeout_us without data, or as soon as
+// some data is there
+static int bench_set_timing(int fd, unsigned int timeout_us)
+{
+    struct rpi_uart_read_timing timing = {
+        .vmin = 0,
+        .first_us = timeout_us,
+        .idle_us = 0,
+    };
+
+    return ioctl(fd, RPI_UART_IOC_SET_READ_TIMING, &timing);
+}
+
+// Read and discard until the line has been quiet for BENCH_DRAIN_US
+static void bench_drain(int fd)
+{
+    char buf[BENCH_READ_SIZE];
+
+    bench_set_timing(fd, BENCH_DRAIN_US);
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+// Write a counting byte pattern until the end time
+static void *bench_writer_thread(void *arg)
+{
+    struct bench_writer *w = arg;
+    unsigned char *buf;
+    unsigned char seq = 0;
+    unsigned int i;
+    ssize_t n;
+
+    buf = malloc(w->size);
+    if (!buf) {
+        w->error = ENOMEM;
+        return NULL;
+    }
+
+    while (bench_now() < w->end) {
+        for (i = 0; i < w->size; i++) {
+            buf[i] = seq++;
+        }
+        n = write(w->fd, buf, w->size);
+        if (n < 0) {
+            w->error = errno;
+            break;
+        }
+        w->sent += n;
+        // Short write after a signal, carry on with the pattern it left off
+        seq -= w->size - n;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Stream for opts->seconds, checking that every byte comes back in order.
+// Returns the received bytes per second.
+static double bench_throughput(int fd, const struct bench_opts *opts, unsigned int size,
+                               unsigned long long *received, unsigned long long *errors)
+{
+    struct bench_writer w = {
+        .fd = fd,
+        .size = size,
+    };
+    unsigned char buf[BENCH_READ_SIZE];
+    unsigned char expect = 0;
+    double start, last;
+    pthread_t thread;
+    ssize_t n, i;
+
+    *received = 0;
+    *errors = 0;
+
+    bench_set_timing(fd, BENCH_DRAIN_US);
+    start = last = bench_now();
+    w.end = start + opts->seconds;
+    if (pthread_create(&thread, NULL, bench_writer_thread, &w)) {
+        return 0;
+    }
+
+    // Once the writer stops, a quiet line means everything has arrived
+    for (;;) {
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+        if (n == 0) {
+            if (bench_now() >= w.end) {
+                break;
+            }
+            continue;
+        }
+
+        last = bench_now();
+        for (i = 0; i < n; i++) {
+            // Resynchronise on the received byte after a loss
+            if (buf[i] != expect) {
+                (*errors)++;
+            }
+            expect = buf[i] + 1;
+        }
+        *received += n;
+    }
+
+    pthread_join(thread, NULL);
+    if (w.error) {
+        fprintf(stderr, "write: %s\n", strerror(w.error));
+    }
+    if (*received < w.sent) {
+        *errors += w.sent - *received;  // Never came back
+    }
+
+    return last > start ? *received / (last - start) : 0;
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Send single messages and time each until it is back, for opts->samples
+// round trips or opts->seconds. Fills lat[] in microseconds and returns
+// the number of samples.
+static unsigned int bench_latency(int fd, const struct bench_opts *opts, double *lat)
+{
+    unsigned char msg[BENCH_READ_SIZE];
+    unsigned char buf[BENCH_READ_SIZE];
+    unsigned int count = 0;
+    unsigned int got;
+    double start, end;
+    ssize_t n;
+
+    end = bench_now() + opts->seconds;
+    memset(msg, 0x55, opts->msg_size);
+    // A lost byte should not hang the run
+    bench_set_timing(fd, 1000000);
+
+    while (count < opts->samples && bench_now() < end) {
+        start = bench_now();
+        if (write(fd, msg, opts->msg_size) != (ssize_t)opts->msg_size) {
+            perror("write");
+            break;
+        }
+
+        for (got = 0; got < opts->msg_size; got += n) {
+            n = read(fd, buf, opts->msg_size - got);
+            if (n <= 0) {
+                break;
+            }
+        }
+        if (got < opts->msg_size) {
+            fprintf(stderr, "latency: message lost\n");
+            bench_drain(fd);
+            bench_set_timing(fd, 1000000);
+            continue;
+        }
+
+        lat[count++] = (bench_now() - start) * 1e6;
+    }
+
+    qsort(lat, count, sizeof(*lat), bench_cmp_double);
+    return count;
+}
+
+static double bench_percentile(const double *sorted, unsigned int count, double p)
+{
+    return count ? sorted[(unsigned int)(p * (count - 1))] : 0;
+}
+
+static void bench_run(int fd, const struct bench_opts *opts, unsigned int baud,
+                      unsigned int size, double *lat)
+{
+    unsigned long long busy0, total0, busy1, total1;
+    unsigned long long received, errors;
+    struct bench_stats st0, st1;
+    double rate, mb, cpu_s, line;
+    long ticks = sysconf(_SC_CLK_TCK);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int count;
+
+    bench_drain(fd);
+    bench_read_stats(opts->dev, &st0);
+
+    if (bench_cpu_ticks(&busy0, &total0)) {
+        busy0 = total0 = 0;
+    }
+    rate = bench_throughput(fd, opts, size, &received, &errors);
+    if (bench_cpu_ticks(&busy1, &total1)) {
+        busy1 = busy0;
+        total1 = total0;
+    }
+
+    count = bench_latency(fd, opts, lat);
+    bench_read_stats(opts->dev, &st1);
+
+    mb = received / 1e6;
+    cpu_s = (double)(busy1 - busy0) / ticks;
+    line = baud / 10.0;
+
+    printf("%8u %6u %10.1f %5.1f%% %9.1f %9.1f %9.1f %6.1f%% %9.1f",
+           baud, size, rate / 1e3, 100 * rate / line,
+           bench_percentile(lat, count, 0.50),
+           bench_percentile(lat, count, 0.99),
+           bench_percentile(lat, count, 0.999),
+           total1 > total0 ? 100.0 * (busy1 - busy0) / (total1 - total0) * cpus : 0,
+           mb > 0 ? cpu_s * 1e3 / mb : 0);
+    bench_print_delta(st0.rx_overruns, st1.rx_overruns);
+    bench_print_delta(st0.rx_dropped, st1.rx_dropped);
+    printf(" %9llu\n", errors);
+    fflush(stdout);
+}
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d dev] [-b baud,...] [-s size,...] [-t seconds] [-n samples] [-m bytes] [-L]\n"
+            "  -d  port to test (default /dev/ttyMU0)\n"
+            "  -b  baud rates (default 115200)\n"
+            "  -s  write sizes of the throughput run (default 64,4096)\n"
+            "  -t  seconds per throughput and per latency run (default 5)\n"
+            "  -n  latency round trips per run (default 1000)\n"
+            "  -m  bytes per latency round trip (default 16)\n"
+            "  -L  loop TX to RX inside the UART (PL011), else a TX/RX jumper is expected\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_opts opts = {
+        .dev = "/dev/ttyMU0",
+        .bauds = { 115200 },
+        .num_bauds = 1,
+        .sizes = { 64, 4096 },
+        .num_sizes = 2,
+        .seconds = 5,
+        .samples = 1000,
+        .msg_size = 16,
+    };
+    unsigned int i, j;
+    __u32 val;
+    double *lat;
+    int ret = 1;
+    int fd;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:b:s:t:n:m:L")) != -1) {
+        switch (c) {
+        case 'd':
+            opts.dev = optarg;
+            break;
+        case 'b':
+            if (bench_parse_list(optarg, opts.bauds, &opts.num_bauds)) {
+                bench_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            if (bench_parse_list(optarg, opts.sizes, &opts.num_sizes)) {
+                bench_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            opts.seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            opts.samples = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            opts.msg_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            opts.loopback = 1;
+            break;
+        default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!opts.seconds || !opts.samples || !opts.msg_size || opts.msg_size > BENCH_READ_SIZE) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    lat = calloc(opts.samples, sizeof(*lat));
+    if (!lat) {
+        perror("calloc");
+        return 1;
+    }
+
+    // Exclusive, so no other reader takes the looped back bytes
+    fd = open(opts.dev, O_RDWR | O_EXCL);
+    if (fd < 0) {
+        perror(opts.dev);
+        goto out_free;
+    }
+
+    val = 1;
+    if (ioctl(fd, RPI_UART_IOC_SET_RAW, &val)) {
+        perror("RPI_UART_IOC_SET_RAW");
+        goto out_close;
+    }
+
+    val = opts.loopback;
+    if (ioctl(fd, RPI_UART_IOC_SET_LOOPBACK, &val) && opts.loopback) {
+        perror("RPI_UART_IOC_SET_LOOPBACK");
+        goto out_close;
+    }
+
+    printf("%s, %s, %u s per run, %u byte latency messages\n", opts.dev,
+           opts.loopback ? "internal loopback" : "TX/RX jumper", opts.seconds, opts.msg_size);
+    printf("%8s %6s %10s %6s %9s %9s %9s %7s %9s %9s %9s %9s\n",
+           "baud", "size", "kB/s", "line", "p50_us", "p99_us", "p999_us",
+           "cpu", "cpu_ms/MB", "overruns", "dropped", "errors");
+
+    for (i = 0; i < opts.num_bauds; i++) {
+        val = opts.bauds[i];
+        if (ioctl(fd, RPI_UART_IOC_SET_BAUD, &val)) {
+            fprintf(stderr, "%u baud: %s\n", val, strerror(errno));
+            continue;
+        }
+
+        for (j = 0; j < opts.num_sizes; j++) {
+            bench_run(fd, &opts, opts.bauds[i], opts.sizes[j], lat);
+        }
+    }
+    ret = 0;
+
+    if (opts.loopback) {
+        val = 0;
+        ioctl(fd, RPI_UART_IOC_SET_LOOPBACK, &val);
+    }
+out_close:
+    close(fd);
+out_free:
+    free(lat);
+    return ret;
+}
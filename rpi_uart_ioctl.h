@@ -0,0 +1,119 @@
+#ifndef RPI_UART_IOCTL_H
+#define RPI_UART_IOCTL_H
+
+// ioctl interface of /dev/ttyMU0, shared with userspace programs
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define RPI_UART_IOC_MAGIC 0xB5
+
+// Line speed in baud, limited by the core clock (clock / 8 maximum)
+#define RPI_UART_IOC_SET_BAUD _IOW(RPI_UART_IOC_MAGIC, 1, __u32)
+#define RPI_UART_IOC_GET_BAUD _IOR(RPI_UART_IOC_MAGIC, 2, __u32)
+
+// Binary mode for this open file (non-zero = on): no CR before LF on
+// write and NUL bytes are kept on read
+#define RPI_UART_IOC_SET_RAW  _IOW(RPI_UART_IOC_MAGIC, 3, __u32)
+#define RPI_UART_IOC_GET_RAW  _IOR(RPI_UART_IOC_MAGIC, 4, __u32)
+
+// When a blocking read() returns, like termios VMIN/VTIME but in
+// microseconds. A read waits first_us for the first byte (0 = forever,
+// returns 0 on timeout), then goes on until count bytes, vmin bytes
+// (if non-zero) or idle_us without new data (0 = return at once).
+struct rpi_uart_read_timing {
+    __u32 vmin;
+    __u32 first_us;
+    __u32 idle_us;
+};
+
+#define RPI_UART_IOC_SET_READ_TIMING _IOW(RPI_UART_IOC_MAGIC, 5, struct rpi_uart_read_timing)
+#define RPI_UART_IOC_GET_READ_TIMING _IOR(RPI_UART_IOC_MAGIC, 6, struct rpi_uart_read_timing)
+
+// Packet mode of the port: the RX path splits the stream at delim and
+// each read() returns one whole frame, without the delimiter (truncated
+// to the read size, like a datagram). Empty frames are skipped, and
+// poll() only reports EPOLLIN once a frame is complete. The read timing
+// first_us still bounds the wait, vmin and idle_us do not apply.
+// mmap() readers still see the raw byte stream.
+#define RPI_UART_FRAME_NONE   0  // Byte stream (default)
+#define RPI_UART_FRAME_DELIM  1  // Frames end with delim
+#define RPI_UART_FRAME_COBS   2  // COBS frames ending with delim (usually 0), decoded by read()
+
+struct rpi_uart_framing {
+    __u32 mode;                // RPI_UART_FRAME_*
+    __u32 delim;               // Delimiter byte, 0-255
+};
+
+#define RPI_UART_IOC_SET_FRAMING _IOW(RPI_UART_IOC_MAGIC, 7, struct rpi_uart_framing)
+#define RPI_UART_IOC_GET_FRAMING _IOR(RPI_UART_IOC_MAGIC, 8, struct rpi_uart_framing)
+
+// Loop TX back to RX inside the UART (non-zero = on), for self-tests and
+// rpi_uart_bench without a jumper. PL011 ports only, the Mini UART
+// returns EOPNOTSUPP. Off after the driver loads.
+#define RPI_UART_IOC_SET_LOOPBACK _IOW(RPI_UART_IOC_MAGIC, 9, __u32)
+#define RPI_UART_IOC_GET_LOOPBACK _IOR(RPI_UART_IOC_MAGIC, 10, __u32)
+
+// mmap() of the device at offset 0 maps the RX ring for reading in place:
+// this header, then size bytes of data at data_offset. head and tail are
+// free-running byte counts, data at (index & (size - 1)). The driver
+// advances head after storing bytes, the reader consumes from tail to
+// head and then advances tail (load-acquire head, store-release tail).
+// poll() reports EPOLLIN while head != tail. Bytes are never translated,
+// and read() on the same device consumes from the same ring. Only a file
+// opened with O_EXCL may map it writable, others map it PROT_READ. The header
+// page also carries the RX timestamps, struct rpi_uart_rx_stamp.
+struct rpi_uart_ring_header {
+    __u32 head;                // Written by the driver
+    __u32 pad0[15];            // head and tail in separate cache lines
+    __u32 tail;                // Written by the reader
+    __u32 pad1[15];
+    __u32 size;                // Data bytes, a power of two
+    __u32 data_offset;         // From the start of the mapping
+    __u32 stamp_head;          // Written by the driver, records stored so far
+    __u32 stamp_count;         // Records in the stamp array, a power of two
+    __u32 stamp_offset;        // Of the stamp array, from the start of the mapping
+};
+
+// RX timestamp of one chunk of received bytes, taken on CLOCK_MONOTONIC_RAW
+// as the chunk came out of the RX FIFO (or DMA buffer) - once per FIFO
+// drain, so its bytes arrived on the wire at most one FIFO fill before.
+// The driver stores record (stamp_head & (stamp_count - 1)), then
+// advances stamp_head (store-release). A record read is only valid if
+// stamp_head has moved less than stamp_count past it afterwards.
+struct rpi_uart_rx_stamp {
+    __u64 ns;
+    __u32 pos;                 // Ring position (like head/tail) of its first byte
+    __u32 len;
+};
+
+// The RX timestamp of the chunk holding the first byte returned by the
+// last read() of this file (in packet mode, the frame's first byte).
+// ns is 0 if there was no read yet, or the reader was so far behind that
+// the record had been overwritten.
+#define RPI_UART_IOC_GET_RX_STAMP _IOR(RPI_UART_IOC_MAGIC, 11, struct rpi_uart_rx_stamp)
+
+// RX line errors of the port. A burst of received bytes (one FIFO drain,
+// or a PL011 error interrupt with RX DMA) in which the UART flagged errors
+// counts once per kind. pos is the ring position right after the bytes
+// of the last such burst: data before it may have gaps or bad bytes, a
+// protocol can resync at pos. poll() reports EPOLLPRI until this file
+// has fetched the latest event. The Mini UART only detects overruns.
+#define RPI_UART_RX_ERR_OVERRUN (1 << 0)  // Bytes lost on a full RX FIFO
+#define RPI_UART_RX_ERR_FRAMING (1 << 1)  // No valid stop bit
+#define RPI_UART_RX_ERR_PARITY  (1 << 2)
+#define RPI_UART_RX_ERR_BREAK   (1 << 3)  // Line held low for a whole frame
+
+struct rpi_uart_rx_errors {
+    __u32 events;              // Bursts with errors so far
+    __u32 pos;                 // Ring position (like head/tail) after the last one
+    __u32 last;                // RPI_UART_RX_ERR_* of the last one
+    __u32 overrun;             // Bursts with each kind of error
+    __u32 framing;
+    __u32 parity;
+    __u32 brk;
+};
+
+#define RPI_UART_IOC_GET_RX_ERRORS _IOR(RPI_UART_IOC_MAGIC, 12, struct rpi_uart_rx_errors)
+
+#endif
@@ -0,0 +1,128 @@
+// Tracepoints on the RX and TX paths of rpi_uart, under
+// /sys/kernel/tracing/events/rpi_uart. The tracing ring buffer
+// timestamps every event, so the gap between two events of one byte
+// stream gives its latency, e.g. irq -> rx_enqueue (FIFO drain),
+// rx_enqueue -> rx_wake (reader wakeup) or rx_dequeue -> copy_to_user
+// (copy cost):
+//
+//   bpftrace -e 'tracepoint:rpi_uart:rpi_uart_rx_enqueue { @t = nsecs; }
+//       tracepoint:rpi_uart:rpi_uart_rx_wake /@t/ { @ns = hist(nsecs - @t); }'
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rpi_uart
+
+#if !defined(RPI_UART_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define RPI_UART_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// The port name, e.g. ttyMU0, is copied into each event
+#define RPI_UART_TRACE_NAME_LEN 16
+
+// Interrupt entry with the status that caused it (MU_IIR or PL011_MIS)
+TRACE_EVENT(rpi_uart_irq,
+    TP_PROTO(const char *name, u32 status),
+    TP_ARGS(name, status),
+    TP_STRUCT__entry(
+        __array(char, name, RPI_UART_TRACE_NAME_LEN)
+        __field(u32, status)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->name, name, RPI_UART_TRACE_NAME_LEN);
+        __entry->status = status;
+    ),
+    TP_printk("%s status=0x%x", __entry->name, __entry->status)
+);
+
+// Byte counts without a ring involved
+DECLARE_EVENT_CLASS(rpi_uart_bytes,
+    TP_PROTO(const char *name, unsigned int bytes),
+    TP_ARGS(name, bytes),
+    TP_STRUCT__entry(
+        __array(char, name, RPI_UART_TRACE_NAME_LEN)
+        __field(unsigned int, bytes)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->name, name, RPI_UART_TRACE_NAME_LEN);
+        __entry->bytes = bytes;
+    ),
+    TP_printk("%s bytes=%u", __entry->name, __entry->bytes)
+);
+
+// Bytes taken from the RX FIFO or the RX DMA buffer
+DEFINE_EVENT(rpi_uart_bytes, rpi_uart_rx_drain,
+    TP_PROTO(const char *name, unsigned int bytes),
+    TP_ARGS(name, bytes)
+);
+
+// Bytes copied by read() and write()
+DEFINE_EVENT(rpi_uart_bytes, rpi_uart_copy_to_user,
+    TP_PROTO(const char *name, unsigned int bytes),
+    TP_ARGS(name, bytes)
+);
+
+DEFINE_EVENT(rpi_uart_bytes, rpi_uart_copy_from_user,
+    TP_PROTO(const char *name, unsigned int bytes),
+    TP_ARGS(name, bytes)
+);
+
+// Bytes moved into or out of a ring, with the ring level afterwards
+DECLARE_EVENT_CLASS(rpi_uart_ring,
+    TP_PROTO(const char *name, unsigned int bytes, unsigned int level),
+    TP_ARGS(name, bytes, level),
+    TP_STRUCT__entry(
+        __array(char, name, RPI_UART_TRACE_NAME_LEN)
+        __field(unsigned int, bytes)
+        __field(unsigned int, level)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->name, name, RPI_UART_TRACE_NAME_LEN);
+        __entry->bytes = bytes;
+        __entry->level = level;
+    ),
+    TP_printk("%s bytes=%u level=%u", __entry->name, __entry->bytes, __entry->level)
+);
+
+DEFINE_EVENT(rpi_uart_ring, rpi_uart_rx_enqueue,
+    TP_PROTO(const char *name, unsigned int bytes, unsigned int level),
+    TP_ARGS(name, bytes, level)
+);
+
+DEFINE_EVENT(rpi_uart_ring, rpi_uart_rx_dequeue,
+    TP_PROTO(const char *name, unsigned int bytes, unsigned int level),
+    TP_ARGS(name, bytes, level)
+);
+
+DEFINE_EVENT(rpi_uart_ring, rpi_uart_tx_enqueue,
+    TP_PROTO(const char *name, unsigned int bytes, unsigned int level),
+    TP_ARGS(name, bytes, level)
+);
+
+DEFINE_EVENT(rpi_uart_ring, rpi_uart_tx_dequeue,
+    TP_PROTO(const char *name, unsigned int bytes, unsigned int level),
+    TP_ARGS(name, bytes, level)
+);
+
+// A sleeping reader woke up and found level bytes in the RX ring
+TRACE_EVENT(rpi_uart_rx_wake,
+    TP_PROTO(const char *name, unsigned int level),
+    TP_ARGS(name, level),
+    TP_STRUCT__entry(
+        __array(char, name, RPI_UART_TRACE_NAME_LEN)
+        __field(unsigned int, level)
+    ),
+    TP_fast_assign(
+        strscpy(__entry->name, name, RPI_UART_TRACE_NAME_LEN);
+        __entry->level = level;
+    ),
+    TP_printk("%s level=%u", __entry->name, __entry->level)
+);
+
+#endif // RPI_UART_TRACE_H
+
+// This header is included again by define_trace.h and is not in include/trace
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rpi_uart_trace
+#include <trace/define_trace.h>
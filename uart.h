@@ -7,13 +7,83 @@
 #include <linux/uaccess.h> // User-space data transfer (copy_from_user)
 #include <linux/io.h>  //  Memory-mapped I/O (ioremap, readl, writel)
 #include <linux/delay.h> // Timing functions (udelay, cpu_relax)
+#include <linux/interrupt.h> // IRQ handling (request_irq, free_irq)
+#include <linux/wait.h> // Wait queues for blocking readers
+#include <linux/slab.h> // Kernel memory allocation (kmalloc, kfree)
+#include <linux/of_irq.h> // Device tree IRQ lookup (irq_of_parse_and_map)
+#include <linux/miscdevice.h> // Character device node (misc_register)
+#include <linux/poll.h> // poll/epoll support (poll_wait)
+#include <linux/platform_device.h> // Parent device for the serial port
+#include <linux/serial_core.h> // serial_core (uart_driver, uart_port)
+#include <linux/tty.h> // termios handling
+#include <linux/tty_flip.h> // Flip buffers (tty_insert_flip_char)
+#include <linux/console.h> // Kernel console (struct console)
+#include <linux/clk.h> // Core clock rate and rate-change notifier
+#include <linux/of_address.h> // Device tree register lookup (of_address_to_resource)
+#include <linux/dmaengine.h> // PL011 DMA (dmaengine_prep_slave_sg)
+#include <linux/dma-mapping.h> // DMA buffers (dma_map_single)
+#include <linux/of_dma.h> // DMA channels from device tree
+#include <linux/hrtimer.h> // High resolution timers
+#include <linux/of.h> // Device tree matching (of_device_id)
+#include <linux/mutex.h> // Sleeping locks
+#include <linux/percpu.h> // Per-CPU statistics
+#include <linux/debugfs.h> // Statistics files
+#include <linux/seq_file.h> // seq_printf
+#include <linux/mm.h> // mmap of the RX ring
+#include <linux/vmalloc.h> // vmalloc_user
+#include <linux/uio.h> // iov_iter for read_iter/write_iter
+#include <linux/workqueue.h> // Kernel consumer callbacks (queue_work)
+#include <linux/rcupdate.h> // Kernel consumer handles outliving their port
+#include <linux/highmem.h> // memcpy_from_page for zero-copy writes
+#include <linux/pm_runtime.h> // Mini UART clock gating when idle
+#include <linux/iopoll.h> // readl_poll_timeout
+#include <linux/pinctrl/consumer.h> // Idle pin state while runtime suspended
+#include <linux/kref.h> // Ports outliving unbind while files are open
+#include <linux/rwsem.h> // File operations against unbind
+#include <linux/of_platform.h> // PL011 device for its pinctrl state (of_find_device_by_node)
+#include <linux/amba/bus.h> // PL011 nodes are usually AMBA devices (amba_bustype)
 
 #define PROC_UART_TX "uart_tx"
 #define PROC_UART_RX "uart_rx" //new chnage
-// Base addresses for BCM2711 
-#define PERIPHERAL_BASE 0xFE000000UL
+#define UART_DEV_NAME "ttyMU0"  // /dev node of the interrupt-driven driver
+#define UART_TTY_NAME "ttyMU"   // serial_core name prefix when loaded with tty=1
+#define UART_PL011_DEV_NAME "ttyPL%d"  // /dev node of PL011 UARTn (pl011=n)
+
+// Board profile, chosen at build time with RPI_UART_BOARD=<SoC> (see
+// Makefile), BCM2711 by default. Device tree still overrides register
+// addresses and clock rates where it has them; these are the fallbacks
+// and the constants the FIFO paths are sized with.
+//   PERIPHERAL_BASE    ARM physical address of the peripheral window
+//   UART_SYSTEM_CLOCK  VPU core clock feeding the Mini UART at its default rate
+//   GPIO_HAS_PUPPDN    GPPUPPDN pull registers (BCM2711) instead of GPPUD/GPPUDCLK
+#ifndef RPI_UART_BOARD
+#define RPI_UART_BOARD 2711
+#endif
+
+#if RPI_UART_BOARD == 2835      // Pi 1, Zero
+#define PERIPHERAL_BASE   0x20000000UL
+#define UART_SYSTEM_CLOCK 250000000U
+#define GPIO_HAS_PUPPDN   0
+#elif RPI_UART_BOARD == 2837    // Pi 2 (BCM2836 too), 3, Zero 2
+#define PERIPHERAL_BASE   0x3F000000UL
+#define UART_SYSTEM_CLOCK 250000000U
+#define GPIO_HAS_PUPPDN   0
+#elif RPI_UART_BOARD == 2711    // Pi 4, 400, CM4, low peripheral mode
+#define PERIPHERAL_BASE   0xFE000000UL
+#define UART_SYSTEM_CLOCK 500000000U
+#define GPIO_HAS_PUPPDN   1
+#elif RPI_UART_BOARD == 2712
+#error "BCM2712 (Pi 5): the header UARTs and GPIOs are on the RP1 south bridge, which this driver does not drive"
+#else
+#error "Unknown RPI_UART_BOARD, use 2835, 2837 or 2711"
+#endif
+
+// The Mini UART is the same on every supported SoC, the PL011 below
+#define MU_FIFO_DEPTH     8
+
 #define AUX_BASE        (PERIPHERAL_BASE + 0x215000)
 #define GPIO_BASE       (PERIPHERAL_BASE + 0x200000)
+#define PL011_BASE(n)   (PERIPHERAL_BASE + 0x201000 + 0x200 * (n))  // UART0, UART2-5
 
 // GPIO Function Select values 
 #define GPIO_FSEL_INPUT  0x0
@@ -48,10 +118,113 @@ struct uart_regs {
     volatile u32 MU_BAUD;       /* 0x68 */
 };
 
+// Size of the Mini UART registers from MU_IO on, as described in device tree
+#define MU_REG_SIZE (sizeof(struct uart_regs) - offsetof(struct uart_regs, MU_IO))
+
+// AUX IRQ / ENABLES bits
+#define AUX_IRQ_MU        (1 << 0)  // Mini UART interrupt pending
+#define AUX_ENABLE_MU     (1 << 0)  // Mini UART enable
+
+// MU_IER bits - the datasheet has bits 0/1 swapped, these follow the errata
+#define MU_IER_RX_IRQ     (1 << 0)  // Interrupt when RX FIFO holds data
+#define MU_IER_TX_IRQ     (1 << 1)  // Interrupt when TX FIFO is empty
+#define MU_IER_REQUIRED   (3 << 2)  // Must be set for any interrupt to fire
+
+// MU_IIR bits
+#define MU_IIR_NO_IRQ     (1 << 0)  // Read: clear when an interrupt is pending
+#define MU_IIR_CLEAR_RX   (1 << 1)  // Write: clear RX FIFO
+#define MU_IIR_CLEAR_TX   (1 << 2)  // Write: clear TX FIFO
+
+// MU_LCR bits - 8-bit mode needs both bits 0 and 1 (datasheet errata)
+#define MU_LCR_7BIT       0x0
+#define MU_LCR_8BIT       0x3
+#define MU_LCR_BREAK      (1 << 6)
+
+// MU_MCR / MU_MSR bits
+#define MU_MCR_RTS        (1 << 1)  // Drive RTS low (asserted)
+#define MU_MSR_CTS        (1 << 4)  // CTS asserted
+
+// MU_LSR bits
+#define MU_LSR_DATA_READY (1 << 0)  // RX FIFO holds at least one byte
+#define MU_LSR_RX_OVERRUN (1 << 1)  // RX FIFO overflowed
+#define MU_LSR_TX_EMPTY   (1 << 5)  // TX FIFO can accept at least one byte
+#define MU_LSR_TX_IDLE    (1 << 6)  // TX FIFO empty and transmitter idle
+
+// MU_STAT bits and FIFO fill levels. Reading MU_STAT clears nothing,
+// the overrun bit stays set until MU_LSR is read.
+#define MU_STAT_RX_OVERRUN (1 << 4)  // Same as MU_LSR_RX_OVERRUN
+#define MU_STAT_TX_DONE    (1 << 9)  // TX FIFO empty and transmitter idle
+#define MU_STAT_RX_LEVEL(stat) (((stat) >> 16) & 0xF)
+#define MU_STAT_TX_LEVEL(stat) (((stat) >> 24) & 0xF)
+
+// MU_CNTL bits
+#define MU_CNTL_RX_EN     (1 << 0)
+#define MU_CNTL_TX_EN     (1 << 1)
+#define MU_CNTL_RX_AUTOFLOW (1 << 2)  // RTS follows the RX FIFO level
+#define MU_CNTL_TX_AUTOFLOW (1 << 3)  // TX pauses while CTS is de-asserted
+#define MU_CNTL_RTS_LEVEL(n) (((3 - (n)) & 3) << 4)  // De-assert RTS with n (1-4) RX FIFO slots free
+
+// PL011 register offsets
+#define PL011_DR     0x00  // Data
+#define PL011_FR     0x18  // Flags
+#define PL011_IBRD   0x24  // Integer baud divisor
+#define PL011_FBRD   0x28  // Fractional baud divisor
+#define PL011_LCRH   0x2C  // Line control
+#define PL011_CR     0x30  // Control
+#define PL011_IFLS   0x34  // FIFO interrupt levels
+#define PL011_IMSC   0x38  // Interrupt mask
+#define PL011_MIS    0x40  // Masked interrupt status
+#define PL011_ICR    0x44  // Interrupt clear
+#define PL011_DMACR  0x48  // DMA control
+#define PL011_REG_SIZE 0x200
+
+// PL011 register bits
+#define PL011_DR_FE        (1 << 8)  // Framing error on this byte
+#define PL011_DR_PE        (1 << 9)  // Parity error on this byte
+#define PL011_DR_BE        (1 << 10) // Break received (this byte is 0)
+#define PL011_DR_OE        (1 << 11) // RX FIFO overflowed before this byte
+#define PL011_DR_ERR       (0xF << 8)
+#define PL011_FR_BUSY      (1 << 3)
+#define PL011_FR_RXFE      (1 << 4)  // RX FIFO empty
+#define PL011_FR_TXFF      (1 << 5)  // TX FIFO full
+#define PL011_LCRH_FEN     (1 << 4)  // FIFO enable
+#define PL011_LCRH_WLEN_8  (3 << 5)
+#define PL011_CR_UARTEN    (1 << 0)
+#define PL011_CR_LBE       (1 << 7)  // Loopback: TX feeds RX internally
+#define PL011_CR_TXE       (1 << 8)
+#define PL011_CR_RXE       (1 << 9)
+#define PL011_IFLS_TX_HALF (2 << 0)
+#define PL011_IFLS_RX_HALF (2 << 3)
+#define PL011_INT_RX       (1 << 4)  // RX FIFO above level
+#define PL011_INT_TX       (1 << 5)  // TX FIFO below level
+#define PL011_INT_RT       (1 << 6)  // RX timeout
+#define PL011_INT_ERR      (0xF << 7) // Framing, parity, break, overrun - the PL011_DR_ERR order
+#define PL011_DMACR_RXDMAE   (1 << 0)
+#define PL011_DMACR_TXDMAE   (1 << 1)
+#define PL011_DMACR_DMAONERR (1 << 2)
+
+// PL011 clock (used when device tree has no clock), FIFO depth and RX DMA
+// buffer layout. The RX DMA position is polled every PL011_RX_POLL_US so
+// a partly filled period still reaches readers. PL011_BUSY_TIMEOUT_US
+// bounds waiting for a full TX FIFO to drain (at 9600 baud) before the
+// UART is disabled.
+#define PL011_CLOCK          48000000U
+#define PL011_FIFO_DEPTH     16
+#define PL011_BUSY_TIMEOUT_US 20000
+#define PL011_RX_DMA_SIZE    4096
+#define PL011_RX_DMA_PERIODS 4
+#define PL011_RX_POLL_US     1000
+
 // GPIO register offsets 
+#define GPFSEL0    0x00  // GPIO Function Select 0
 #define GPFSEL1    0x04  // GPIO Function Select 1 
 #define GPPUD      0x94  /* GPIO Pin Pull-up/down Enable */
 #define GPPUDCLK0  0x98  /* GPIO Pin Pull-up/down Enable Clock 0 */
 #define GPPUPPDN0  0xE4  /* GPIO Pull-up/down for pins 0-15 (BCM2711) */
+#define GPPUPPDN1  0xE8  /* GPIO Pull-up/down for pins 16-31 (BCM2711) */
+
+// UART pins are all below 20: two GPFSEL and two GPPUPPDN registers
+#define GPIO_FSEL_REGS 2
+#define GPIO_PULL_REGS 2
 
 #endif